@@ -0,0 +1,126 @@
+#include <string.h>
+#include "lz.h"
+
+// a small LZ77 codec in the LZ4 block format: each sequence is a token
+// (4 bits of literal length, 4 bits of match length - 4), the literals,
+// a 2 byte offset back into the output and the match; lengths of 15 or
+// more go on in extra bytes. The last sequence only has literals.
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (12)
+
+// hash of the 4 bytes at p, used to find earlier occurrences of them
+static unsigned int LZ_Hash(unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// write the part of a length past 15 as bytes of 255 and a remainder
+static int LZ_PutLength(unsigned char *out, int op, int len) {
+    while (len >= 255) {
+        out[op++] = 255;
+        len -= 255;
+    }
+    out[op++] = len;
+    return op;
+}
+
+// write one sequence of literals followed by a match (none if match_len is 0)
+static int LZ_Emit(unsigned char *out, int op, int cap, unsigned char *lit, int lit_len, int offset, int match_len) {
+    int extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + extra / 255 + 1 > cap) return -1; // worst case size
+
+    int token = op++;
+    out[token] = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) op = LZ_PutLength(out, op, lit_len - 15);
+    memcpy(out + op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        out[token] |= (extra >= 15 ? 15 : extra);
+        out[op++] = offset & 0xff;
+        out[op++] = offset >> 8;
+        if (extra >= 15) op = LZ_PutLength(out, op, extra - 15);
+    }
+    return op;
+}
+
+int LZ_Compress(char *src, int n, char *dst, int cap) {
+    unsigned char *in = (unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    int table[1 << LZ_HASH_BITS]; // last position of each hashed 4 bytes
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    int ip = 0, op = 0, anchor = 0; // anchor is the first literal not yet written
+    while (ip + LZ_MIN_MATCH <= n) {
+        unsigned int h = LZ_Hash(in + ip);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // extend the match as far as it goes
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len])
+            len++;
+
+        op = LZ_Emit(out, op, cap, in + anchor, ip - anchor, ip - ref, len);
+        if (op == -1) return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    // the rest are literals
+    return LZ_Emit(out, op, cap, in + anchor, n - anchor, 0, 0);
+}
+
+int LZ_Decompress(char *src, int n, char *dst, int cap) {
+    unsigned char *in = (unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+
+    int ip = 0, op = 0;
+    while (ip < n) {
+        int token = in[ip++];
+        int b;
+
+        // literals
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = in[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > n || op + lit_len > cap) return -1;
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == n) break; // last sequence has no match
+
+        // match, copied byte by byte since it may overlap itself
+        if (ip + 2 > n) return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int match_len = token & 15;
+        if (match_len == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = in[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + match_len > cap) return -1;
+        for (int i = 0; i < match_len; i++)
+            out[op + i] = out[op - offset + i];
+        op += match_len;
+    }
+
+    return op;
+}
@@ -0,0 +1,16 @@
+#ifndef __LZ_h__
+#define __LZ_h__
+
+//
+// prototypes
+//
+
+// compress n bytes of src into dst, returns the compressed length
+// or -1 if it does not fit in cap bytes
+int LZ_Compress(char *src, int n, char *dst, int cap);
+
+// decompress n bytes of src into dst, returns the decompressed length
+// or -1 if src is corrupt or the result does not fit in cap bytes
+int LZ_Decompress(char *src, int n, char *dst, int cap);
+
+#endif // __LZ_h__
@@ -6,22 +6,36 @@
 #include "udp.h"
 #include "mfs.h"
 
-struct sockaddr_in addr, return_addr;
+#define MFS_MAX_REPLICAS (4) // primary plus followers of a shard
 
-int MFS_Transmit_Helper(Packet *send_packet, Packet *return_packet) {
+struct sockaddr_in addr[MFS_MAX_SHARDS][MFS_MAX_REPLICAS], return_addr;
+int num_shards = 0; // num of servers the namespace is sharded across
+int num_replicas[MFS_MAX_SHARDS]; // num of servers holding each shard, the primary first
+int next_replica[MFS_MAX_SHARDS]; // server of each shard to send the next read to
+int client_id; // id servers may be set up to tell this process apart from others of its host by
+int request_seq = 0; // num of requests sent so far, lets servers spot retransmissions
+int read_followers = 0; // 1 when reads may be answered by followers, which may lag behind
 
+// send a request to a shard's primary, or to any of its servers if any_replica is set
+int MFS_Transmit(int shard, Packet *send_packet, Packet *return_packet, int any_replica) {
+
+    if (shard < 0 || shard >= num_shards) return -1; // inum does not belong to any server
     int fd = UDP_Open(0);
     if (fd < -1) return -1;
+    send_packet->client = client_id;
+    send_packet->seq = ++request_seq;
 
     fd_set rfds;
     struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
 
     while (1) {
+        int replica = 0;
+        if (any_replica) replica = next_replica[shard]++ % num_replicas[shard]; // retry on another server
         FD_ZERO(&rfds);
         FD_SET(fd, &rfds);
-        UDP_Write(fd, &addr, (char*)send_packet, sizeof(Packet));
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        UDP_Write(fd, &addr[shard][replica], (char*)send_packet, sizeof(Packet));
         if (select(fd+1, &rfds, NULL, NULL, &tv)){
             if (UDP_Read(fd, &return_addr, (char*)return_packet, sizeof(Packet)) > 0){
                 UDP_Close(fd);
@@ -31,8 +45,78 @@ int MFS_Transmit_Helper(Packet *send_packet, Packet *return_packet) {
     }
 }
 
+int MFS_Transmit_Helper(int shard, Packet *send_packet, Packet *return_packet) {
+
+    // reads are spread over the primary and its followers if the client allows it,
+    // everything else goes to the primary
+    int read_only = (send_packet->request == LOOKUP || send_packet->request == STAT ||
+                     send_packet->request == READ || send_packet->request == LOOKUP_PATH ||
+                     send_packet->request == READDIR || send_packet->request == SNAPSHOT_LIST);
+    return MFS_Transmit(shard, send_packet, return_packet, read_only && read_followers);
+}
+
+// lookup answered by the primary, for when the answer decides what to change
+int MFS_Lookup_Primary(int pinum, char *name) {
+
+    Packet send_packet;
+    Packet return_packet;
+    send_packet.inum = pinum;
+    strcpy(send_packet.name, name);
+    send_packet.request = LOOKUP;
+
+    if (MFS_Transmit(MFS_SHARD_OF(pinum), &send_packet, &return_packet, 0) < 0) return -1;
+
+    return return_packet.return_val;
+}
+
+// pick the shard a new inode is placed on: files stay with their parent,
+// directories are spread across the shards by hashing their name
+int MFS_Place(int pinum, int type, char *name) {
+    if (type != MFS_DIRECTORY) return MFS_SHARD_OF(pinum);
+    unsigned int hash = pinum;
+    for (char *c = name; *c != '\0'; c++)
+        hash = hash * 31 + *c;
+    return hash % num_shards;
+}
+
 int MFS_Init(char *hostname, int port) {
-    if (UDP_FillSockAddr(&addr, hostname, port) == -1) return -1;
+
+    char hosts[1024];
+    strncpy(hosts, hostname, sizeof(hosts) - 1);
+    hosts[sizeof(hosts) - 1] = '\0';
+
+    // one server per shard, in shard order, each maybe followed by +host[:port] followers
+    num_shards = 0;
+    for (char *host = strtok(hosts, ","); host != NULL; host = strtok(NULL, ",")) {
+        if (num_shards == MFS_MAX_SHARDS) return -1;
+        num_replicas[num_shards] = 0;
+        next_replica[num_shards] = 0;
+        while (host != NULL) {
+            if (num_replicas[num_shards] == MFS_MAX_REPLICAS) return -1;
+            char *next = strchr(host, '+');
+            if (next != NULL) *next++ = '\0';
+            int host_port = port;
+            char *colon = strchr(host, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                host_port = atoi(colon + 1);
+            }
+            if (UDP_FillSockAddr(&addr[num_shards][num_replicas[num_shards]], host, host_port) == -1) return -1;
+            num_replicas[num_shards]++;
+            host = next;
+        }
+        num_shards++;
+    }
+    if (num_shards == 0) return -1;
+
+    // processes sharing an id share a server's weight and rate limit set for it
+    char *id = getenv("MFS_CLIENT");
+    client_id = (id != NULL) ? atoi(id) : getpid();
+    return 0;
+}
+
+int MFS_ReadFollowers(int allow){
+    read_followers = allow;
     return 0;
 }
 
@@ -44,11 +128,44 @@ int MFS_Lookup(int pinum, char *name){
     strcpy(send_packet.name, name);
     send_packet.request = LOOKUP;
 
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(pinum), &send_packet, &return_packet) < 0) return -1;
 
     return return_packet.return_val;
 }
 
+int MFS_LookupPath(int pinum, char *path, int *inums){
+
+    Packet send_packet;
+    Packet return_packet;
+    if (strlen(path) >= MFS_BLOCK_SIZE) return -1;
+
+    // the server walks the path as far as its shard goes, then the next shard carries on
+    int resolved = 0;
+    while (1) {
+        send_packet.inum = pinum;
+        strcpy(send_packet.buffer, path);
+        send_packet.request = LOOKUP_PATH;
+
+        if (MFS_Transmit_Helper(MFS_SHARD_OF(pinum), &send_packet, &return_packet) < 0) return -1;
+
+        int done = return_packet.block; // num of components resolved by this server
+        if (inums != NULL)
+            memcpy(inums + resolved, return_packet.buffer, done * sizeof(int));
+        resolved += done;
+        if (return_packet.return_val == -1) return -1;
+        pinum = return_packet.return_val;
+
+        // skip the components resolved so far
+        for (int i = 0; i < done; i++) {
+            while (*path == '/') path++;
+            while (*path != '\0' && *path != '/') path++;
+        }
+        while (*path == '/') path++;
+        if (*path == '\0') return pinum;
+        if (done == 0) return -1; // server made no progress
+    }
+}
+
 int MFS_Stat(int inum, MFS_Stat_t *m) {
 
     Packet send_packet;
@@ -56,7 +173,7 @@ int MFS_Stat(int inum, MFS_Stat_t *m) {
     send_packet.inum = inum;
     send_packet.request = STAT;
 	
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
 
     if (return_packet.return_val == -1) return -1;
     else {
@@ -66,17 +183,50 @@ int MFS_Stat(int inum, MFS_Stat_t *m) {
     }
 }
 
+int MFS_ReadDir(int inum, int *cursor, MFS_DirEnt_t *entries, MFS_Stat_t *stats, int max){
+
+    Packet send_packet;
+    Packet return_packet;
+
+    int count = 0;
+    while (count < max && *cursor != -1) {
+        send_packet.inum = inum;
+        send_packet.block = *cursor;
+        send_packet.length = max - count;
+        send_packet.type = (stats != NULL); // whether to send the stat of each entry along
+        send_packet.request = READDIR;
+
+        if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
+        if (return_packet.return_val == -1) return -1;
+
+        // the packet holds the entries, then their stat
+        int listed = return_packet.return_val;
+        memcpy(entries + count, return_packet.buffer, listed * sizeof(MFS_DirEnt_t));
+        if (stats != NULL) {
+            memcpy(stats + count, return_packet.buffer + listed * sizeof(MFS_DirEnt_t), listed * sizeof(MFS_Stat_t));
+            for (int i = count; i < count + listed; i++) {
+                if (stats[i].type == -1 && MFS_Stat(entries[i].inum, &stats[i]) == -1) return -1; // entry on another shard
+            }
+        }
+        count += listed;
+        *cursor = return_packet.block;
+    }
+
+    return count;
+}
+
 int MFS_Write(int inum, char *buffer, int block){
 	
     Packet send_packet;
     Packet return_packet;
+    if (MFS_SNAPSHOT_OF(inum) != 0) return -1; // snapshots are read-only
     send_packet.inum = inum;
     for(int i = 0; i < MFS_BLOCK_SIZE; i++)
         send_packet.buffer[i] = buffer[i];
     send_packet.block = block;
     send_packet.request = WRITE;
 	
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
 	
     return return_packet.return_val;
 }
@@ -89,7 +239,7 @@ int MFS_Read(int inum, char *buffer, int block){
     send_packet.block = block;
     send_packet.request = READ;
 
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
 
     if (return_packet.return_val == -1) return -1;
     else{
@@ -103,27 +253,92 @@ int MFS_Creat(int pinum, int type, char *name){
 	
     Packet send_packet;
     Packet return_packet;
+    if (MFS_SNAPSHOT_OF(pinum) != 0) return -1; // snapshots are read-only
+    int shard = MFS_Place(pinum, type, name);
+
+    if (shard == MFS_SHARD_OF(pinum)) {
+        // parent and child live on the same shard, one request does it all
+        send_packet.inum = pinum;
+        send_packet.type = type;
+        strcpy(send_packet.name, name);
+        send_packet.request = CREAT;
+
+        if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+
+        return return_packet.return_val;
+    }
+
+    // cross-shard creat: allocate the child on its own shard,
+    // then name it in the parent directory on the parent's shard;
+    // dying in between leaves an unnamed inode, never a name without one
+    if (strlen(name) > 27) return -1;
+    if (MFS_Lookup_Primary(pinum, name) != -1) return 0; // name already exists
+
     send_packet.inum = pinum;
     send_packet.type = type;
-    strcpy(send_packet.name, name);
-    send_packet.request = CREAT;
+    send_packet.request = ALLOC;
+    if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+    int inum = return_packet.return_val;
+    if (inum == -1) return -1;
 
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    send_packet.inum = pinum;
+    strcpy(send_packet.name, name);
+    send_packet.child = inum;
+    send_packet.request = LINK;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(pinum), &send_packet, &return_packet) < 0) return -1;
+    if (return_packet.return_val == -1) {
+        // parent could not take the name, do not leave the child behind
+        send_packet.inum = inum;
+        send_packet.type = 0;
+        send_packet.request = FREE;
+        MFS_Transmit_Helper(shard, &send_packet, &return_packet);
+        return (MFS_Lookup_Primary(pinum, name) != -1) ? 0 : -1; // someone else took the name first
+    }
 
-    return return_packet.return_val;
+    return 0;
 }
 
 int MFS_Unlink(int pinum, char *name){
 	
     Packet send_packet;
     Packet return_packet;
+    if (MFS_SNAPSHOT_OF(pinum) != 0) return -1; // snapshots are read-only
+
+    int inum = MFS_Lookup_Primary(pinum, name);
+    int cross = (inum != -1 && MFS_SHARD_OF(inum) != MFS_SHARD_OF(pinum));
+    if (cross) {
+        // a child on another shard must be freeable before its name goes away
+        send_packet.inum = inum;
+        send_packet.type = 1; // only check
+        send_packet.request = FREE;
+        if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
+        if (return_packet.return_val == -1) return -1;
+    }
+
     send_packet.inum = pinum;
     strcpy(send_packet.name, name);
     send_packet.request = UNLINK;
 
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(pinum), &send_packet, &return_packet) < 0) return -1;
+    if (return_packet.return_val == -1 || !cross) return return_packet.return_val;
 
-    return return_packet.return_val;
+    // the name is gone, free the child on its own shard; dying in between
+    // leaves an unnamed inode, never a name pointing at a freed one
+    send_packet.inum = inum;
+    send_packet.type = 0;
+    send_packet.request = FREE;
+    if (MFS_Transmit_Helper(MFS_SHARD_OF(inum), &send_packet, &return_packet) < 0) return -1;
+    if (return_packet.return_val == -1) {
+        // the directory filled up since the check, give it its name back
+        send_packet.inum = pinum;
+        strcpy(send_packet.name, name);
+        send_packet.child = inum;
+        send_packet.request = LINK;
+        MFS_Transmit_Helper(MFS_SHARD_OF(pinum), &send_packet, &return_packet);
+        return -1;
+    }
+
+    return 0;
 }
 
 int MFS_Shutdown(){
@@ -132,7 +347,81 @@ int MFS_Shutdown(){
     Packet return_packet;
     send_packet.request = SHUTDOWN;
 
-    if (MFS_Transmit_Helper(&send_packet, &return_packet) < 0) return -1;
+    for (int shard = 0; shard < num_shards; shard++) {
+        if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+    }
 	
     return 0;
 }
+
+int MFS_SnapshotList_Helper(int shard, MFS_Snapshot_t *snaps){
+
+    Packet send_packet;
+    Packet return_packet;
+    send_packet.request = SNAPSHOT_LIST;
+
+    if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+    if (return_packet.return_val == -1) return -1;
+
+    memcpy(snaps, return_packet.buffer, return_packet.return_val * sizeof(MFS_Snapshot_t));
+    return return_packet.return_val;
+}
+
+int MFS_Snapshot(){
+
+    Packet send_packet;
+    Packet return_packet;
+
+    // find the ids in use on any shard
+    int used[MFS_MAX_SNAPSHOTS + 1] = {0};
+    MFS_Snapshot_t snaps[MFS_MAX_SNAPSHOTS];
+    for (int shard = 0; shard < num_shards; shard++) {
+        int n = MFS_SnapshotList_Helper(shard, snaps);
+        if (n == -1) return -1;
+        for (int i = 0; i < n; i++)
+            used[snaps[i].id] = 1;
+    }
+
+    // take a free id on every shard; if another client takes it first on some
+    // shard, give it back where this call got it and try the next free id
+    for (int snap = 1; snap <= MFS_MAX_SNAPSHOTS; snap++) {
+        if (used[snap]) continue;
+        int shard;
+        for (shard = 0; shard < num_shards; shard++) {
+            send_packet.inum = snap;
+            send_packet.request = SNAPSHOT;
+            if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+            if (return_packet.return_val == -1) break;
+        }
+        if (shard == num_shards) return snap;
+        for (int taken = 0; taken < shard; taken++) {
+            send_packet.inum = snap;
+            send_packet.request = SNAPSHOT_DELETE;
+            MFS_Transmit_Helper(taken, &send_packet, &return_packet);
+        }
+    }
+
+    return -1; // no id is free on every shard
+}
+
+int MFS_SnapshotList(MFS_Snapshot_t *snaps){
+
+    // every shard keeps the same snapshots, the first one answers for all
+    return MFS_SnapshotList_Helper(0, snaps);
+}
+
+int MFS_SnapshotDelete(int snap){
+
+    Packet send_packet;
+    Packet return_packet;
+    send_packet.inum = snap;
+    send_packet.request = SNAPSHOT_DELETE;
+
+    int rc = 0;
+    for (int shard = 0; shard < num_shards; shard++) {
+        if (MFS_Transmit_Helper(shard, &send_packet, &return_packet) < 0) return -1;
+        if (return_packet.return_val == -1) rc = -1;
+    }
+
+    return rc;
+}
@@ -10,6 +10,22 @@
 #define MFS_IMAP_PIECE_INODE_NUM (16)
 #define MFS_IMAP_PIECE_NUM (256) // 256 come from 4096(maximum num of nodes)/16(num of inodes in imap pieces)
 #define MFS_MAX_ENTRIES_PER_DIR (128) // 128 come from 4096(size of block)/32(size of directory entry)
+#define MFS_INLINE_MAX (1024) // largest block 0 stored inline, right after its inode in the log
+#define MFS_MAX_SHARDS (16) // maximum num of servers the namespace can be sharded across
+#define MFS_MAX_SNAPSHOTS (16) // maximum num of snapshots an image keeps at once
+#define MFS_IMAGE_MAGIC (0x3153464c) // first word of an image, "LFS1"
+#define MFS_IMAGE_VERSION (1) // format of the image, bumped whenever the layout of anything in the log changes
+
+// inode numbers seen by clients are global: the shard owning the inode times
+// MFS_INODE_NUM plus the inode's local number inside that shard's image
+#define MFS_GLOBAL_INUM(shard, inum) ((shard) * MFS_INODE_NUM + (inum))
+#define MFS_SHARD_OF(inum) ((inum) / MFS_INODE_NUM % MFS_MAX_SHARDS)
+#define MFS_LOCAL_INUM(inum) ((inum) % MFS_INODE_NUM)
+
+// a snapshot is read through the global inums of the live namespace tagged with the
+// snapshot id, read-only; the root directory of snapshot s is MFS_SNAPSHOT_INUM(s, 0)
+#define MFS_SNAPSHOT_INUM(snap, inum) ((snap) * MFS_MAX_SHARDS * MFS_INODE_NUM + (inum))
+#define MFS_SNAPSHOT_OF(inum) ((inum) / (MFS_MAX_SHARDS * MFS_INODE_NUM))
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
@@ -26,6 +42,9 @@ typedef struct __MFS_Inode_t{
     int size;
     int type;
     int data[MFS_INODE_BLOCK_NUM];
+    int data_size[MFS_INODE_BLOCK_NUM]; // bytes each block takes in the log, less than MFS_BLOCK_SIZE if compressed
+    int inline_size; // bytes of block 0 kept in inline_data, -1 if block 0 is not inline
+    char inline_data[MFS_INLINE_MAX]; // only inline_size bytes of it are stored in the log
 } MFS_Inode_t;
 
 typedef struct __MFS_ImapPiece_t{
@@ -36,9 +55,23 @@ typedef struct __MFS_DirBlock_t {
   MFS_DirEnt_t DirEntry[MFS_MAX_ENTRIES_PER_DIR]; 
 } MFS_DirBlock_t;
 
+// a snapshot is a copy of the imap frozen in the log, the imap pieces, inodes and
+// blocks it points to are never overwritten; a cleaner must keep whatever it
+// reaches in the log before end_of_log alive for as long as the snapshot exists
+typedef struct __MFS_Snapshot_t{
+    int id; // 1 to MFS_MAX_SNAPSHOTS, 0 if the slot is unused
+    int imap; // address of the frozen imap
+    int end_of_log; // log the snapshot may point into ends here
+    int time; // seconds since the epoch when the snapshot was taken
+} MFS_Snapshot_t;
+
 typedef struct __MFS_CR_t{
+    int magic;   // MFS_IMAGE_MAGIC, images written before it was added lack it
+    int version; // MFS_IMAGE_VERSION of the server that made the image
     int imap[MFS_IMAP_PIECE_NUM]; 
     int end_of_log;
+    int shard; // shard this image belongs to
+    MFS_Snapshot_t snapshots[MFS_MAX_SNAPSHOTS]; // snapshot id is slot + 1
 } MFS_CR_t; // CR = checkpoint region
 
 
@@ -50,7 +83,17 @@ enum REQUEST {
     READ,
     CREAT,
     UNLINK,
-    SHUTDOWN
+    SHUTDOWN,
+    ALLOC,  // allocate an inode whose parent lives on another shard
+    LINK,   // add a name for an inode living on another shard
+    FREE,   // release an inode whose parent lives on another shard
+    REPLICATE,  // primary shipping a piece of its log to a follower
+    CHECKPOINT, // primary shipping its checkpoint region to a follower
+    LOOKUP_PATH, // resolve a whole path, walked on the server
+    READDIR,    // list the used entries of a directory
+    SNAPSHOT,   // freeze the current imap as a snapshot
+    SNAPSHOT_LIST,   // list the snapshots kept
+    SNAPSHOT_DELETE  // forget a snapshot
 };
 
 typedef struct __Packet {
@@ -61,17 +104,45 @@ typedef struct __Packet {
     char buffer[MFS_BLOCK_SIZE];
     int block;
     int type;
+    int child; // inum of the entry to add for LINK
+    int offset; // log address of the shipped piece for REPLICATE
+    int length; // bytes of log in buffer for REPLICATE
+    int client; // id a server may be set up to tell processes of one host apart by, the sender's pid unless MFS_CLIENT is set
+    int seq; // num of the client's request, the same in each retransmission of it
     int return_val;
 } Packet;
 
 
+// hostname may be a comma separated list of host[:port] servers, one per shard
+// in shard order; entries without a port use the given one. A shard's primary
+// may be followed by +host[:port] followers, which are sent reads once
+// MFS_ReadFollowers allows it
 int MFS_Init(char *hostname, int port);
+// lets LOOKUP, STAT, READ, LOOKUP_PATH, READDIR and snapshot listing requests go to
+// followers (off by default). A follower may not have the client's latest writes
+// yet unless the primaries run with -a; lookups made to decide a change always
+// go to the primary
+int MFS_ReadFollowers(int allow);
 int MFS_Lookup(int pinum, char *name);
+// resolves a '/' separated path relative to pinum in one request per shard it
+// crosses; if inums is not NULL it gets the inum of each component in order
+int MFS_LookupPath(int pinum, char *path, int *inums);
 int MFS_Stat(int inum, MFS_Stat_t *m);
+// lists up to max used entries of directory inum starting at *cursor (0 for the
+// first call), with their stat in stats if it is not NULL; returns the num of
+// entries listed and moves *cursor on, to -1 once the whole directory is listed
+int MFS_ReadDir(int inum, int *cursor, MFS_DirEnt_t *entries, MFS_Stat_t *stats, int max);
 int MFS_Write(int inum, char *buffer, int block);
 int MFS_Read(int inum, char *buffer, int block);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
+// takes a snapshot of every shard, returns its id or -1; it costs a copy of the
+// imap per shard whatever the amount of data. Shards are not frozen atomically
+// together, each snapshot holds its shard as of the moment it got the request
+int MFS_Snapshot();
+// fills snaps (room for MFS_MAX_SNAPSHOTS) with the snapshots kept, returns their num
+int MFS_SnapshotList(MFS_Snapshot_t *snaps);
+int MFS_SnapshotDelete(int snap);
 
 #endif // __MFS_h__
@@ -1,200 +1,1173 @@
+#define _GNU_SOURCE // for pinning threads to cores
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include "udp.h"
 #include "mfs.h"
-
-int lfs_init(int port, char* image_path);
+#include "lz.h"
+
+#define MFS_MAX_FOLLOWERS (8) // maximum num of followers a primary ships its log to
+#define MFS_FOLLOWER_RETRY (5) // seconds before a follower that stopped answering is tried again
+#define MFS_MAX_WORKERS (64) // maximum num of threads receiving requests
+#define MFS_CACHE_BLOCK_NUM (64) // num of blocks kept in the block cache
+#define MFS_READAHEAD_MIN (2) // num of blocks read ahead once a reader is seen to be sequential
+#define MFS_READAHEAD_MAX (8) // maximum num of blocks read ahead of a sequential reader
+#define MFS_READAHEAD_SPAN (2 * MFS_READAHEAD_MAX * MFS_BLOCK_SIZE) // largest piece of log read at once
+#define MFS_MAX_CLIENTS (64) // num of clients the scheduler keeps queues for at once
+#define MFS_MAX_QUEUED (256) // num of requests waiting in the scheduler's queues at once
+#define MFS_MAX_CLIENT_QUEUED (MFS_MAX_QUEUED / 4) // num of those one client may hold, more are dropped
+#define MFS_NUM_CLASSES (3) // request classes, each with queues of its own
+#define MFS_CLASS_METADATA (0) // requests that only look at the namespace
+#define MFS_CLASS_READ (1)
+#define MFS_CLASS_WRITE (2) // requests that change the log
+#define MFS_LATENCY_BUCKETS (32) // bucket i counts requests served in less than 2^i us
+#define MFS_RECEIVE_BATCH (16) // num of packets a worker takes off its socket before queueing them
+#define MFS_REPLY_NUM (1024) // num of clients whose last answer to a change is kept
+
+// a follower receiving the log of this server
+typedef struct __Follower {
+  struct sockaddr_in addr;
+  int received; // bytes of log the follower holds, -1 until it has answered
+  int acked;    // last commit the follower has applied
+  time_t down;  // time the follower stopped answering, 0 while it is up
+} Follower;
+
+// a block of the log kept in memory, the log is never overwritten so it cannot go stale
+typedef struct __CacheBlock {
+  int addr; // log address of the block, -1 if the slot is unused
+  int used; // last time the block was used, the least recently used one is evicted
+  char data[MFS_BLOCK_SIZE];
+} CacheBlock;
+
+// access pattern of an inode's reader
+typedef struct __Readahead {
+  int next;  // block a sequential reader asks for next
+  int depth; // num of blocks kept read ahead, 0 until sequential access is seen
+  int end;   // blocks before end have been read ahead
+} Readahead;
+
+// a request taken off a socket, waiting in the scheduler's queues
+typedef struct __Request {
+  Packet packet;
+  struct sockaddr_in addr; // client to answer
+  int fd;                  // socket to answer on
+  long long arrival;       // time the request was taken off the socket
+  int next;                // next request in the same queue (or free list), -1 for none
+} Request;
+
+// the answer to a client's last change, kept to answer retransmissions of it
+typedef struct __Reply {
+  in_addr_t host; // address and socket the change came from
+  int port;
+  int client;     // id and seq carried by the change
+  int seq;
+  int return_val;
+} Reply;
+
+// a client of the scheduler, known by the address its packets come from
+typedef struct __Client {
+  in_addr_t host;
+  int id;         // id the packets carry, only told apart when by_id is set
+  int by_id;      // 1 if the slot takes only the packets of host carrying id
+  int in_use;     // 0 if the slot is unused
+  int fixed;      // 1 if set up on the command line, the slot is then never reused
+  int weight;     // requests of a class served in a row when the client's turn comes
+  int rate;       // requests per second the client may make, 0 for no limit
+  double tokens;  // requests the client may make now under its rate
+  long long refilled; // time tokens were last added
+  int waiting;    // num of requests queued
+  int head[MFS_NUM_CLASSES]; // oldest request queued in each class, -1 if none
+  int tail[MFS_NUM_CLASSES]; // newest request queued in each class
+} Client;
+
+// counters reported when the server shuts down
+typedef struct __Stats {
+  int reads;             // blocks asked for by READ requests
+  int cache_hits;        // of those, served from the block cache
+  int inline_reads;      // of those, served from an inline block 0
+  int readahead_batches; // reads of the log made by readahead
+  int readahead_blocks;  // blocks read by readahead
+  int readahead_wasted;  // blocks read ahead but never asked for
+  int compressed_blocks;   // blocks stored compressed
+  int decompressed_blocks; // compressed blocks read back
+  long long raw_bytes;     // bytes of the blocks offered for compression
+  long long stored_bytes;  // bytes those blocks take in the log
+  long long compress_ns;   // cpu time spent compressing
+  long long decompress_ns; // cpu time spent decompressing
+  int served[MFS_NUM_CLASSES]; // requests answered in each class
+  int latency[MFS_NUM_CLASSES][MFS_LATENCY_BUCKETS]; // time from taking them off the socket to answering
+  int dropped;             // requests dropped because every client slot was busy
+  int retransmissions;     // requests dropped because they were already queued
+  int over_limit;          // requests dropped because their client had too many queued
+} Stats;
+
+int lfs_init(int port, char* image_path, int shard);
+int lfs_handle(Packet* send_packet, Packet* return_packet, struct sockaddr_in* addr);
+int lfs_run_workers(int port);
+void* lfs_worker(void* arg);
+int lfs_loop(int fd);
+int lfs_serve(int fd);
+int lfs_receive(int fd, int* slots, int n);
+int lfs_enqueue(int* slots, int taken, int reserved);
+int lfs_queued(Client* c, int k, Request* r);
+Request* lfs_schedule();
+Request* lfs_pick(int k);
+int lfs_ready(Client* c);
+int lfs_sched_timeout();
+Client* lfs_client(in_addr_t host, int id);
+Client* lfs_find_client(in_addr_t host, int id, int by_id);
+Client* lfs_new_client(in_addr_t host, int id, int by_id);
+int lfs_class(int request);
+long long lfs_clock_ns();
+int lfs_local_inum(int inum);
+int lfs_append(void* buffer, int size);
+int lfs_get_inode(int inum, MFS_Inode_t* inode);
+int lfs_find_inode(int inum, MFS_Inode_t* inode);
+int lfs_read_inode(int imap_piece_addr, int inum, MFS_Inode_t* inode);
+int lfs_put_inode(int inum, MFS_Inode_t* inode);
+int lfs_get_block(MFS_Inode_t* inode, int block, char* buffer);
+int lfs_set_block(MFS_Inode_t* inode, int block, char* buffer);
+int lfs_block_used(int type, char* buffer);
+int lfs_append_block(char* buffer, int* size);
+int lfs_read_block(int addr, int size, char* buffer);
+int lfs_load_block(int addr, int size, char* buffer);
+int lfs_unpack_block(char* stored, int size, char* buffer);
+long long lfs_cpu_ns();
+int lfs_commit();
+int lfs_replicate();
+int lfs_follower_rpc(Follower* f, Packet* send_packet, Packet* return_packet);
+int lfs_apply(int offset, char* buffer, int length);
+int lfs_checkpoint(MFS_CR_t* cr);
+char* lfs_cache_get(int addr);
+char* lfs_cache_put(int addr);
+int lfs_cache_drop(int addr);
+int lfs_readahead(MFS_Inode_t* inode, int from, int to);
+int lfs_print_stats();
 int lfs_lookup(int pinum, char* name);
+int lfs_lookup_path(int pinum, char* path, int* inums, int* resolved);
 int lfs_stat(int inum, MFS_Stat_t* m);
+int lfs_readdir(int inum, int cursor, int max, int plus, char* buffer, int* next);
 int lfs_write(int inum, char* buffer, int block);
 int lfs_read(int inum, char* buffer, int block);
 int lfs_creat(int pinum, int type, char* name);
 int lfs_unlink(int pinum, char* name);
+int lfs_alloc(int pinum, int type);
+int lfs_link(int pinum, char* name, int inum);
+int lfs_free(int inum, int check);
+int lfs_snapshot(int snap);
+int lfs_snapshot_list(char* buffer);
+int lfs_snapshot_delete(int snap);
 int lfs_shutdown();
 
 int fs_image; // global variable to store file system image
 MFS_CR_t* CR; // global variable to store checkpoint region
+MFS_CR_t boot_cr; // checkpoint region a primary started with, the log its followers share for sure
+int num_workers = 1; // num of threads receiving requests, each on its own socket
+int worker_fds[MFS_MAX_WORKERS]; // socket of each worker
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER; // guards the file system when there are several workers
+pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER; // guards the scheduler's queues and clients
+
+int follower_mode = 0; // 1 when this server only applies the log shipped by a primary
+int received = 0; // bytes of log a follower holds, applied or not
+Follower followers[MFS_MAX_FOLLOWERS]; // followers of a primary
+int num_followers = 0;
+int sync_replication = 0; // 1 when commits wait for follower acks instead of a local fsync
+int commit_seq = 0; // num of commits made by a primary
+int compress_blocks = 0; // 1 when blocks are compressed as they are added to the log
+int rep_fd = -1; // socket a primary ships its log from
+int rep_seq = 0; // num of packets a primary shipped to its followers
+
+CacheBlock cache[MFS_CACHE_BLOCK_NUM]; // block cache filled by reads and readahead
+int cache_clock = 0; // num of cache uses so far
+Readahead inode_readahead[MFS_INODE_NUM]; // readahead state of each local inode
+Stats stats;
+
+Request requests[MFS_MAX_QUEUED]; // requests taken off the sockets
+int free_request = -1; // first unused request
+Client clients[MFS_MAX_CLIENTS];
+int class_weight[MFS_NUM_CLASSES] = {8, 4, 1}; // requests of each class served in a round while all are busy
+int class_left[MFS_NUM_CLASSES]; // requests each class may still be served this round
+int turn[MFS_NUM_CLASSES];       // client whose turn it is in each class
+int turn_left[MFS_NUM_CLASSES];  // requests that client may still be served in its turn
+Reply replies[MFS_REPLY_NUM]; // last answer to a change of each client, by hash of where it came from
 
 
 // method to initialize and run a log-structured file server
-int lfs_init(int port, char* image_path) {
+int lfs_init(int port, char* image_path, int shard) {
+
+  CR = (MFS_CR_t *)malloc(sizeof(MFS_CR_t));
+  if (num_followers > 0) rep_fd = UDP_Open(0);
+  for (int i = 0; i < MFS_CACHE_BLOCK_NUM; i++)
+    cache[i].addr = -1;
+  for (int i = MFS_MAX_QUEUED - 1; i >= 0; i--) {
+    requests[i].next = free_request;
+    free_request = i;
+  }
 
   // try to open the given file system image
   fs_image = open(image_path, O_RDWR);
-  
+
   // check if given file is empty
   if (fs_image == -1){
     // given file is empty, do the initialization
     // creation and initialization of the checkpoint region
-    fs_image = open(image_path, O_RDWR|O_CREAT);
+    fs_image = open(image_path, O_RDWR|O_CREAT, 0644);
 
-    CR = (MFS_CR_t *)malloc(sizeof(MFS_CR_t)); 
-    CR->end_of_log = 0;
+    CR->magic = MFS_IMAGE_MAGIC;
+    CR->version = MFS_IMAGE_VERSION;
+    CR->end_of_log = sizeof(MFS_CR_t); // log starts right after CR
+    CR->shard = shard;
     for(int i = 0; i < MFS_IMAP_PIECE_NUM; i++)
       CR->imap[i] = -1;
-    // add CR to file image
-    lseek(fs_image, CR->end_of_log, SEEK_SET);
-    write(fs_image, CR, sizeof(MFS_CR_t));
-    CR->end_of_log += sizeof(MFS_CR_t); // update CR->end_of_log for future lseek
-
-    // creation and initialization of the root directory
-    MFS_DirBlock_t root_dir;
-    strcpy(root_dir.DirEntry[0].name, ".\0");
-    root_dir.DirEntry[0].inum = 0;
-    strcpy(root_dir.DirEntry[1].name, "..\0");
-    root_dir.DirEntry[1].inum = 0;
-    for(int i = 2; i < MFS_MAX_ENTRIES_PER_DIR; i++)
-      root_dir.DirEntry[i].inum = -1;
-    // add root directory to file image
-    lseek(fs_image, CR->end_of_log, SEEK_SET);
-    write(fs_image, &root_dir, sizeof(MFS_DirBlock_t));
-    CR->end_of_log += sizeof(MFS_DirBlock_t); // update CR->end_of_log for future lseek
-
-    // set up the inode for the root directory
-    MFS_Inode_t root_inode;
-    root_inode.size = MFS_BLOCK_SIZE; 
-    root_inode.type = MFS_DIRECTORY;
-    root_inode.data[0] = CR->end_of_log - sizeof(MFS_DirBlock_t); // address of root directory in the file image
-    for (int i = 1; i < MFS_INODE_BLOCK_NUM; i++) 
-      root_inode.data[i] = -1; 
-    // add root directory's inode to file image
-    lseek(fs_image, CR->end_of_log, SEEK_SET);
-    write(fs_image, &root_inode, sizeof(MFS_Inode_t));
-    CR->end_of_log += sizeof(MFS_Inode_t); // update CR->end_of_log for future lseek
-
-    // set up imap_piece for root directory's inode
-    MFS_ImapPiece_t imap_piece;
-    imap_piece.inodes[0] = CR->end_of_log - sizeof(MFS_Inode_t); // address of root directory's inode
-    for(int i = 1; i < MFS_IMAP_PIECE_INODE_NUM; i++) 
-      imap_piece.inodes[i] = -1;
-
-    lseek(fs_image, CR->end_of_log, SEEK_SET);
-    write(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
-    CR->end_of_log += sizeof(MFS_ImapPiece_t);  
-
-    // update checkpoint region after change in imap and end_of_log
-    CR->imap[0] = CR->end_of_log - sizeof(MFS_ImapPiece_t);
-    lseek(fs_image, 0, SEEK_SET);
-    write(fs_image, CR, sizeof(MFS_CR_t));
-    fsync(fs_image); // commit changes to disk after write
+    for(int i = 0; i < MFS_MAX_SNAPSHOTS; i++)
+      CR->snapshots[i].id = 0;
+    memcpy(&boot_cr, CR, sizeof(MFS_CR_t));
+    lfs_commit();
+
+    // only the first shard holds the root directory, the others start with an empty imap
+    // a follower gets its root from the primary
+    if (shard == 0 && follower_mode == 0) {
+      // creation and initialization of the root directory
+      MFS_DirBlock_t root_dir;
+      strcpy(root_dir.DirEntry[0].name, ".\0");
+      root_dir.DirEntry[0].inum = 0;
+      strcpy(root_dir.DirEntry[1].name, "..\0");
+      root_dir.DirEntry[1].inum = 0;
+      for(int i = 2; i < MFS_MAX_ENTRIES_PER_DIR; i++)
+        root_dir.DirEntry[i].inum = -1;
+
+      // set up the inode for the root directory and add both to the log
+      MFS_Inode_t root_inode;
+      root_inode.size = MFS_BLOCK_SIZE;
+      root_inode.type = MFS_DIRECTORY;
+      root_inode.inline_size = -1;
+      for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++)
+        root_inode.data[i] = -1;
+      lfs_set_block(&root_inode, 0, (char*)&root_dir);
+      lfs_put_inode(0, &root_inode);
+      lfs_commit();
+    }
   }
   else {
     // given file exists, retrieve its checkpoint region
     lseek(fs_image, 0, SEEK_SET);
-    read(fs_image, CR, sizeof(MFS_CR_t));
+    if (read(fs_image, CR, sizeof(MFS_CR_t)) != sizeof(MFS_CR_t) || CR->magic != MFS_IMAGE_MAGIC) {
+      printf("image %s is not a file system image of this server, or was made by an older one\n", image_path);
+      return -1;
+    }
+    if (CR->version != MFS_IMAGE_VERSION) {
+      printf("image %s has format version %d, this server reads version %d\n", image_path, CR->version, MFS_IMAGE_VERSION);
+      return -1;
+    }
+    if (CR->shard != shard) {
+      printf("image %s belongs to shard %d, not %d\n", image_path, CR->shard, shard);
+      return -1;
+    }
+    memcpy(&boot_cr, CR, sizeof(MFS_CR_t));
   } // end of file system image initialization
+  received = CR->end_of_log;
 
   // start running the server
+  if (num_workers > 1) return lfs_run_workers(port);
+
   // open port with given port num and deal with requests
   int fd = UDP_Open(port);
   if (fd < 0) return -1;
+  return lfs_loop(fd);
+}
 
-  struct sockaddr_in addr;
-  Packet send_packet, return_packet;
+
+// method to run a request against the file system and fill in the answer
+// a change retransmitted by the client from addr gets the answer it got the first time
+// instead of being made again; returns -1 for an invalid request
+int lfs_handle(Packet* send_packet, Packet* return_packet, struct sockaddr_in* addr) {
+
+  Reply* reply = NULL;
+  if (lfs_class(send_packet->request) == MFS_CLASS_WRITE) {
+    unsigned int hash = addr->sin_addr.s_addr * 31 + addr->sin_port;
+    reply = &replies[(hash * 31 + send_packet->client) % MFS_REPLY_NUM];
+    if (reply->host == addr->sin_addr.s_addr && reply->port == addr->sin_port &&
+        reply->client == send_packet->client && reply->seq == send_packet->seq) {
+      return_packet->return_val = reply->return_val;
+      return 0;
+    }
+  }
+
+  // a follower serves reads only, its log is changed by the primary
+  if (follower_mode == 1 && send_packet->request != LOOKUP && send_packet->request != STAT &&
+      send_packet->request != READ && send_packet->request != LOOKUP_PATH &&
+      send_packet->request != READDIR && send_packet->request != SNAPSHOT_LIST && send_packet->request != REPLICATE &&
+      send_packet->request != CHECKPOINT && send_packet->request != SHUTDOWN) {
+    return_packet->return_val = -1;
+    return 0;
+  }
+
+  if(send_packet->request == LOOKUP){
+    return_packet->return_val = lfs_lookup(send_packet->inum, send_packet->name);
+  }
+  else if(send_packet->request == LOOKUP_PATH){
+    send_packet->buffer[MFS_BLOCK_SIZE-1] = '\0';
+    return_packet->return_val = lfs_lookup_path(send_packet->inum, send_packet->buffer,
+                                                (int*)return_packet->buffer, &(return_packet->block));
+  }
+  else if(send_packet->request == STAT){
+    return_packet->return_val = lfs_stat(send_packet->inum, &(return_packet->stat));
+  }
+  else if(send_packet->request == READDIR){
+    return_packet->return_val = lfs_readdir(send_packet->inum, send_packet->block, send_packet->length,
+                                            send_packet->type, return_packet->buffer, &(return_packet->block));
+  }
+  else if(send_packet->request == WRITE){
+    return_packet->return_val = lfs_write(send_packet->inum, send_packet->buffer, send_packet->block);
+  }
+  else if(send_packet->request == READ){
+    return_packet->return_val = lfs_read(send_packet->inum, return_packet->buffer, send_packet->block);
+  }
+  else if(send_packet->request == CREAT){
+    return_packet->return_val = lfs_creat(send_packet->inum, send_packet->type, send_packet->name);
+  }
+  else if(send_packet->request == UNLINK){
+    return_packet->return_val = lfs_unlink(send_packet->inum, send_packet->name);
+  }
+  else if(send_packet->request == ALLOC){
+    return_packet->return_val = lfs_alloc(send_packet->inum, send_packet->type);
+    if (return_packet->return_val != -1) lfs_commit();
+  }
+  else if(send_packet->request == LINK){
+    return_packet->return_val = lfs_link(send_packet->inum, send_packet->name, send_packet->child);
+    if (return_packet->return_val != -1) lfs_commit();
+  }
+  else if(send_packet->request == FREE){
+    return_packet->return_val = lfs_free(send_packet->inum, send_packet->type); // type 1 only checks
+    if (return_packet->return_val != -1 && send_packet->type != 1) lfs_commit();
+  }
+  else if(send_packet->request == SNAPSHOT){
+    return_packet->return_val = lfs_snapshot(send_packet->inum);
+  }
+  else if(send_packet->request == SNAPSHOT_LIST){
+    return_packet->return_val = lfs_snapshot_list(return_packet->buffer);
+  }
+  else if(send_packet->request == SNAPSHOT_DELETE){
+    return_packet->return_val = lfs_snapshot_delete(send_packet->inum);
+  }
+  else if(send_packet->request == REPLICATE){
+    return_packet->request = REPLICATE;
+    return_packet->offset = send_packet->offset; // lets the primary match the ack
+    return_packet->return_val = lfs_apply(send_packet->offset, send_packet->buffer, send_packet->length);
+  }
+  else if(send_packet->request == CHECKPOINT){
+    return_packet->request = CHECKPOINT;
+    return_packet->offset = send_packet->offset;
+    return_packet->return_val = lfs_checkpoint((MFS_CR_t*)send_packet->buffer);
+  }
+  else if(send_packet->request == SHUTDOWN) {
+    // the caller answers, then shuts down
+  }
+  else {
+    return -1; // invalid request
+  }
+
+  if (reply != NULL) {
+    reply->host = addr->sin_addr.s_addr;
+    reply->port = addr->sin_port;
+    reply->client = send_packet->client;
+    reply->seq = send_packet->seq;
+    reply->return_val = return_packet->return_val;
+  }
+  return 0;
+}
+
+
+// method to run num_workers threads, each pinned to a core and serving its own
+// SO_REUSEPORT socket, over which the kernel spreads the clients
+int lfs_run_workers(int port) {
+  pthread_t workers[MFS_MAX_WORKERS];
+  for (long i = 0; i < num_workers; i++) {
+    worker_fds[i] = UDP_OpenReuse(port);
+    if (worker_fds[i] < 0) return -1;
+    if (pthread_create(&workers[i], NULL, lfs_worker, (void*)i) != 0) return -1;
+  }
+  for (int i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+  return 0;
+}
+
+
+// method run by each worker thread: an epoll loop receiving on the worker's socket
+// the file system is shared by all workers and used under fs_lock
+void* lfs_worker(void* arg) {
+
+  int id = (long)arg;
+  int fd = worker_fds[id];
+
+  // pin worker to a core of its own
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+
+  lfs_loop(fd);
+  return NULL;
+}
+
+
+// method to serve the requests arriving on fd: an epoll loop waking up when packets arrive
+// or when a rate limited client may go on; every worker runs one on its own socket
+int lfs_loop(int fd) {
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  int ep = epoll_create1(0);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event);
 
   while (1) {
-    if (UDP_Read(fd, &addr, (char *)&send_packet, sizeof(Packet)) < 1) continue;
+    pthread_mutex_lock(&sched_lock);
+    int timeout = lfs_sched_timeout();
+    int full = (free_request == -1);
+    pthread_mutex_unlock(&sched_lock);
+    // with every request queued the socket cannot be drained and would wake the loop at once,
+    // wait for a rate limited client alone
+    if (full && timeout > 0) usleep(timeout * 1000);
+    else if (timeout != 0) epoll_wait(ep, &event, 1, timeout);
+    // an invalid request stops a single threaded server, workers drop it
+    if (lfs_serve(fd) == -1 && num_workers == 1) return -1;
+  }
+  return 0;
+}
+
 
-    if(send_packet.request == LOOKUP){
-      return_packet.return_val = lfs_lookup(send_packet.inum, send_packet.name);
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+// method to take the packets waiting on fd into the scheduler's queues and answer the
+// requests the scheduler picks, until none is ready; the socket is drained again before
+// each pick so a request arriving behind a burst does not wait for all of it
+// packets are received and answered without holding a lock, sched_lock guards the queues
+// and fs_lock the file system; returns -1 if an invalid request was dropped
+int lfs_serve(int fd) {
+
+  int rc = 0;
+  Packet return_packet;
+  int slots[MFS_RECEIVE_BATCH];
+  while (1) {
+    // take some free requests and fill them from the socket
+    pthread_mutex_lock(&sched_lock);
+    int reserved = 0;
+    while (reserved < MFS_RECEIVE_BATCH && free_request != -1) {
+      slots[reserved++] = free_request;
+      free_request = requests[free_request].next;
     }
-    else if(send_packet.request == STAT){
-      return_packet.return_val = lfs_stat(send_packet.inum, &(return_packet.stat));
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+    pthread_mutex_unlock(&sched_lock);
+    int taken = lfs_receive(fd, slots, reserved);
+
+    pthread_mutex_lock(&sched_lock);
+    lfs_enqueue(slots, taken, reserved);
+    Request* r = lfs_schedule();
+    pthread_mutex_unlock(&sched_lock);
+    if (r == NULL) return rc;
+
+    // the request is off the queues, it belongs to this worker until it is released
+    pthread_mutex_lock(&fs_lock);
+    int valid = lfs_handle(&r->packet, &return_packet, &r->addr);
+    pthread_mutex_unlock(&fs_lock);
+    if (valid != -1) UDP_Write(r->fd, &r->addr, (char*)&return_packet, sizeof(Packet));
+    else rc = -1;
+
+    int request = r->packet.request;
+    pthread_mutex_lock(&sched_lock);
+    if (valid != -1) {
+      int k = lfs_class(request);
+      int us = (lfs_clock_ns() - r->arrival) / 1000;
+      int bucket = 0;
+      while (bucket < MFS_LATENCY_BUCKETS - 1 && (1 << bucket) <= us) bucket++;
+      stats.served[k]++;
+      stats.latency[k][bucket]++;
     }
-    else if(send_packet.request == WRITE){
-      return_packet.return_val = lfs_write(send_packet.inum, send_packet.buffer, send_packet.block);
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+    r->next = free_request;
+    free_request = r - requests;
+    pthread_mutex_unlock(&sched_lock);
+    if (valid == -1) continue;
+
+    pthread_mutex_lock(&fs_lock);
+    if (request == SHUTDOWN) lfs_shutdown();
+    // without sync replication the log is shipped after the client got its answer
+    if (num_followers > 0 && sync_replication == 0) lfs_replicate();
+    pthread_mutex_unlock(&fs_lock);
+  }
+}
+
+
+// method to read packets waiting on fd into the n requests in slots, reserved by the caller
+// so no lock is needed; returns the num of packets read
+int lfs_receive(int fd, int* slots, int n) {
+  int taken = 0;
+  while (taken < n) {
+    Request* r = &requests[slots[taken]];
+    if (UDP_Read(fd, &r->addr, (char*)&r->packet, sizeof(Packet)) < 1) break;
+    r->fd = fd;
+    r->arrival = lfs_clock_ns();
+    taken++;
+  }
+  return taken;
+}
+
+
+// method to add the first taken of the reserved requests in slots to the queue of their
+// client and class, and give the others back; a retransmission of a request still queued is
+// dropped, one that comes after the request was served gets its answer from the reply cache
+// if it is a change; a request of a client with MFS_MAX_CLIENT_QUEUED queued is dropped too
+// returns the num queued
+int lfs_enqueue(int* slots, int taken, int reserved) {
+
+  int queued = 0;
+  for (int n = 0; n < reserved; n++) {
+    Request* r = &requests[slots[n]];
+    Client* c = NULL;
+    int k = 0;
+    if (n < taken) {
+      c = lfs_client(r->addr.sin_addr.s_addr, r->packet.client);
+      if (c == NULL) stats.dropped++; // every client slot is busy, the client sends again
+      else {
+        k = lfs_class(r->packet.request);
+        if (lfs_queued(c, k, r) == 1) {
+          stats.retransmissions++;
+          c = NULL;
+        }
+        else if (c->waiting >= MFS_MAX_CLIENT_QUEUED) {
+          stats.over_limit++; // a throttled client must not take every request, it sends again
+          c = NULL;
+        }
+      }
     }
-    else if(send_packet.request == READ){
-      return_packet.return_val = lfs_read(send_packet.inum, return_packet.buffer, send_packet.block);
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+    if (c == NULL) {
+      // not taken, or dropped
+      r->next = free_request;
+      free_request = slots[n];
+      continue;
     }
-    else if(send_packet.request == CREAT){
-      return_packet.return_val = lfs_creat(send_packet.inum, send_packet.type, send_packet.name);
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+
+    // add the request at the tail of its queue
+    r->next = -1;
+    if (c->head[k] == -1) c->head[k] = slots[n];
+    else requests[c->tail[k]].next = slots[n];
+    c->tail[k] = slots[n];
+    c->waiting++;
+    queued++;
+  }
+  return queued;
+}
+
+
+// method to find if the request r is a retransmission of one in its client's queue of class k
+int lfs_queued(Client* c, int k, Request* r) {
+  for (int i = c->head[k]; i != -1; i = requests[i].next) {
+    Request* q = &requests[i];
+    if (q->packet.seq == r->packet.seq && q->packet.client == r->packet.client &&
+        q->addr.sin_addr.s_addr == r->addr.sin_addr.s_addr && q->addr.sin_port == r->addr.sin_port)
+      return 1;
+  }
+  return 0;
+}
+
+
+// method to pick the next request to serve, NULL if none is ready
+// classes share the server by weighted round robin, metadata first in each round, so
+// a metadata request waits for at most the request being served when it arrives
+Request* lfs_schedule() {
+
+  for (int round = 0; round < 2; round++) {
+    for (int k = 0; k < MFS_NUM_CLASSES; k++) {
+      if (class_left[k] == 0) continue; // class used up its share of this round
+      Request* r = lfs_pick(k);
+      if (r != NULL) {
+        class_left[k]--;
+        return r;
+      }
     }
-    else if(send_packet.request == UNLINK){
-      return_packet.return_val = lfs_unlink(send_packet.inum, send_packet.name);
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
+    // the classes with requests waiting have used up their shares, start a new round
+    for (int k = 0; k < MFS_NUM_CLASSES; k++)
+      class_left[k] = class_weight[k];
+  }
+  return NULL;
+}
+
+
+// method to take the next request of class k off its queues, NULL if none is ready
+// clients take turns, each serving up to its weight of requests in a row (deficit round
+// robin with every request costing one), skipping clients over their rate
+Request* lfs_pick(int k) {
+
+  for (int n = 0; n <= MFS_MAX_CLIENTS; n++) {
+    Client* c = &clients[turn[k]];
+    if (turn_left[k] > 0 && c->in_use && c->head[k] != -1 && lfs_ready(c)) {
+      turn_left[k]--;
+      if (c->rate > 0) c->tokens -= 1;
+      Request* r = &requests[c->head[k]];
+      c->head[k] = r->next;
+      if (c->head[k] == -1) c->tail[k] = -1;
+      c->waiting--;
+      return r;
     }
-    else if(send_packet.request == SHUTDOWN) {
-      UDP_Write(fd, &addr, (char*)&return_packet, sizeof(Packet));
-      lfs_shutdown();
+    // client is done for this turn, pass it on
+    turn[k] = (turn[k] + 1) % MFS_MAX_CLIENTS;
+    turn_left[k] = clients[turn[k]].weight;
+  }
+  return NULL;
+}
+
+
+// method to add the tokens a rate limited client earned since last time
+// returns 1 if the client may make a request now
+int lfs_ready(Client* c) {
+  if (c->rate == 0) return 1; // no limit
+  long long now = lfs_clock_ns();
+  c->tokens += (now - c->refilled) * c->rate / 1e9;
+  if (c->tokens > c->rate) c->tokens = c->rate; // bursts of up to a second of requests
+  c->refilled = now;
+  return c->tokens >= 1;
+}
+
+
+// method to find how long to wait for packets before serving again
+// returns 0 if a request is ready, -1 if none is queued, or else the ms until a rate
+// limited client may go on
+int lfs_sched_timeout() {
+  int timeout = -1;
+  for (int i = 0; i < MFS_MAX_CLIENTS; i++) {
+    Client* c = &clients[i];
+    if (!c->in_use || c->waiting == 0) continue;
+    if (lfs_ready(c)) return 0;
+    int ms = (1 - c->tokens) * 1000 / c->rate + 1;
+    if (timeout == -1 || ms < timeout) timeout = ms;
+  }
+  return timeout;
+}
+
+
+// method to find the client of a packet from host carrying id, taking a slot for a new one
+// all the processes of a host are one client, unless the command line sets an id apart
+// returns NULL if every slot holds a client with requests queued
+Client* lfs_client(in_addr_t host, int id) {
+  Client* c = lfs_find_client(host, id, 1);
+  if (c == NULL) c = lfs_find_client(host, 0, 0);
+  if (c == NULL) c = lfs_new_client(host, 0, 0);
+  return c;
+}
+
+
+// method to find the slot of host, or of host and id if by_id is set, NULL if it has none
+Client* lfs_find_client(in_addr_t host, int id, int by_id) {
+  for (int i = 0; i < MFS_MAX_CLIENTS; i++) {
+    Client* c = &clients[i];
+    if (c->in_use && c->host == host && c->by_id == by_id && (!by_id || c->id == id)) return c;
+  }
+  return NULL;
+}
+
+
+// method to take a slot for a new client, NULL if every slot holds a client with requests queued
+Client* lfs_new_client(in_addr_t host, int id, int by_id) {
+  Client* spare = NULL;
+  for (int i = 0; i < MFS_MAX_CLIENTS && spare == NULL; i++) {
+    Client* c = &clients[i];
+    if (!c->in_use || (!c->fixed && c->waiting == 0)) spare = c;
+  }
+  if (spare == NULL) return NULL;
+
+  // a client not set up on the command line gets an equal share and no limit
+  spare->host = host;
+  spare->id = id;
+  spare->by_id = by_id;
+  spare->in_use = 1;
+  spare->weight = 1;
+  spare->rate = 0;
+  for (int k = 0; k < MFS_NUM_CLASSES; k++) {
+    spare->head[k] = -1;
+    spare->tail[k] = -1;
+  }
+  return spare;
+}
+
+
+// method to find the class of a request
+int lfs_class(int request) {
+  switch (request) {
+    case READ:
+      return MFS_CLASS_READ;
+    case WRITE: case CREAT: case UNLINK: case ALLOC: case LINK: case FREE:
+    case SNAPSHOT: case SNAPSHOT_DELETE:
+      return MFS_CLASS_WRITE;
+    default:
+      // lookups, stats and listings; replication too, as the primary waits on it
+      return MFS_CLASS_METADATA;
+  }
+}
+
+
+// method to read a clock for measuring time between events, in ns
+long long lfs_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// method to translate a global inum into this shard's local inum, -1 if owned by another shard
+// or if it is the inum of a snapshot, which cannot be changed
+int lfs_local_inum(int inum) {
+  if (inum < 0 || MFS_SHARD_OF(inum) != CR->shard || MFS_SNAPSHOT_OF(inum) != 0) return -1;
+  return MFS_LOCAL_INUM(inum);
+}
+
+
+// method to add size bytes at end_of_log, returns their address in the file image
+// nothing is ever overwritten in place, so everything past the last checkpoint is new
+int lfs_append(void* buffer, int size) {
+  int addr = CR->end_of_log;
+  lseek(fs_image, addr, SEEK_SET);
+  write(fs_image, buffer, size);
+  CR->end_of_log += size; // update CR->end_of_log for future lseek
+  return addr;
+}
+
+
+// method to find the inode with given local inum, returns its address or -1 if it does not exist
+int lfs_get_inode(int inum, MFS_Inode_t* inode) {
+
+  if (inum < 0 || inum >= MFS_INODE_NUM) return -1; // check if inum is valid
+
+  // find imap piece
+  return lfs_read_inode(CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM], inum, inode);
+}
+
+
+// method to find the inode with given global inum, live or in a snapshot, for reading
+// returns its address or -1 if it does not exist
+int lfs_find_inode(int inum, MFS_Inode_t* inode) {
+
+  if (inum < 0 || MFS_SHARD_OF(inum) != CR->shard) return -1; // owned by another shard
+  int snap = MFS_SNAPSHOT_OF(inum);
+  inum = MFS_LOCAL_INUM(inum);
+  if (snap == 0) return lfs_get_inode(inum, inode);
+  if (snap > MFS_MAX_SNAPSHOTS || CR->snapshots[snap-1].id == 0) return -1; // check if snapshot exists
+
+  // only the entry of the needed imap piece is read from the frozen imap
+  int imap_piece_addr;
+  lseek(fs_image, CR->snapshots[snap-1].imap + (inum / MFS_IMAP_PIECE_INODE_NUM) * sizeof(int), SEEK_SET);
+  read(fs_image, &imap_piece_addr, sizeof(int));
+  return lfs_read_inode(imap_piece_addr, inum, inode);
+}
+
+
+// method to find the inode with given local inum through the imap piece at imap_piece_addr
+int lfs_read_inode(int imap_piece_addr, int inum, MFS_Inode_t* inode) {
+
+  if (imap_piece_addr == -1) return -1; // check if imap piece exists
+  MFS_ImapPiece_t imap_piece;
+  lseek(fs_image, imap_piece_addr, SEEK_SET);
+  read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
+
+  // find inode
+  int inode_addr = imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
+  if (inode_addr == -1) return -1; // check if inode exists
+  lseek(fs_image, inode_addr, SEEK_SET);
+  read(fs_image, inode, sizeof(MFS_Inode_t)); // brings an inline block 0 along
+  if (inode->inline_size > MFS_INLINE_MAX) return -1; // corrupt inode, its block 0 would not fit
+
+  return inode_addr;
+}
+
+
+// method to append a new version of the inode with given local inum and of its imap piece
+// a NULL inode removes inum from the imap
+int lfs_put_inode(int inum, MFS_Inode_t* inode) {
+
+  // find imap piece, start a new one if there is none yet
+  MFS_ImapPiece_t imap_piece;
+  int imap_piece_addr = CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM];
+  if (imap_piece_addr == -1) {
+    for (int i = 0; i < MFS_IMAP_PIECE_INODE_NUM; i++)
+      imap_piece.inodes[i] = -1;
+  }
+  else {
+    lseek(fs_image, imap_piece_addr, SEEK_SET);
+    read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
+  }
+
+  if (inode == NULL) imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM] = -1;
+  else {
+    // the inode record ends with block 0 when it is inline
+    int record_size = offsetof(MFS_Inode_t, inline_data);
+    if (inode->inline_size > 0) record_size += inode->inline_size;
+    imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM] = lfs_append(inode, record_size);
+  }
+
+  // check if imap piece is empty, an empty piece is dropped from the imap
+  int empty_piece = 1; // 1 stand for empty imap piece
+  for(int i = 0; i < MFS_IMAP_PIECE_INODE_NUM; i++){
+    if (imap_piece.inodes[i] != -1) {
+      empty_piece = 0; // 0 stand for not empty imap piece
+      break;
     }
-    else {
-      return -1; // invalid request
+  }
+  if (empty_piece == 1) CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] = -1;
+  else CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] = lfs_append(&imap_piece, sizeof(MFS_ImapPiece_t));
+
+  return 0;
+}
+
+
+// method to read the given block of an inode, returns -1 if it has not been written
+int lfs_get_block(MFS_Inode_t* inode, int block, char* buffer) {
+
+  if (block == 0 && inode->inline_size >= 0) {
+    // block 0 is inline, everything past its kept bytes is zeros or unused entries
+    memcpy(buffer, inode->inline_data, inode->inline_size);
+    memset(buffer + inode->inline_size, 0, MFS_BLOCK_SIZE - inode->inline_size);
+    if (inode->type == MFS_DIRECTORY) {
+      MFS_DirBlock_t* dir_block = (MFS_DirBlock_t*)buffer;
+      for (int j = inode->inline_size / sizeof(MFS_DirEnt_t); j < MFS_MAX_ENTRIES_PER_DIR; j++)
+        dir_block->DirEntry[j].inum = -1;
     }
+    return 0;
   }
+
+  if (inode->data[block] == -1) return -1;
+  return lfs_read_block(inode->data[block], inode->data_size[block], buffer);
+}
+
+
+// method to add a new version of the given block of an inode to the log
+// a small block 0 of an inode without other blocks is kept inline, the caller then puts the inode
+int lfs_set_block(MFS_Inode_t* inode, int block, char* buffer) {
+
+  int others = 0; // num of blocks besides block 0
+  for (int i = 1; i < MFS_INODE_BLOCK_NUM; i++)
+    if (inode->data[i] != -1 || i == block) others++;
+
+  int used = lfs_block_used(inode->type, buffer);
+  if (block == 0 && others == 0 && used <= MFS_INLINE_MAX) {
+    memcpy(inode->inline_data, buffer, used);
+    inode->inline_size = used;
+    inode->data[0] = -1;
+    return 0;
+  }
+
+  // an inline block 0 gets a block of its own once the inode grows past it
+  if (block != 0 && inode->inline_size >= 0) {
+    char block0[MFS_BLOCK_SIZE];
+    lfs_get_block(inode, 0, block0);
+    inode->data[0] = lfs_append_block(block0, &inode->data_size[0]);
+  }
+  inode->inline_size = -1;
+
+  inode->data[block] = lfs_append_block(buffer, &inode->data_size[block]);
   return 0;
 }
 
 
-// method used to response to lookup requests
-int lfs_lookup(int pinum, char* name) {
+// method to add a block to the log, compressed if that is on and makes it smaller
+// returns its address and sets size to the bytes it takes in the log
+int lfs_append_block(char* buffer, int* size) {
+
+  if (compress_blocks == 1) {
+    char packed[MFS_BLOCK_SIZE];
+    long long start = lfs_cpu_ns();
+    int packed_size = LZ_Compress(buffer, MFS_BLOCK_SIZE, packed, MFS_BLOCK_SIZE - 1);
+    stats.compress_ns += lfs_cpu_ns() - start;
+    stats.raw_bytes += MFS_BLOCK_SIZE;
+    if (packed_size != -1) {
+      stats.compressed_blocks++;
+      stats.stored_bytes += packed_size;
+      *size = packed_size;
+      return lfs_append(packed, packed_size);
+    }
+    stats.stored_bytes += MFS_BLOCK_SIZE; // does not compress, store it as it is
+  }
+
+  *size = MFS_BLOCK_SIZE;
+  return lfs_append(buffer, MFS_BLOCK_SIZE);
+}
+
+
+// method to read a block taking size bytes at addr in the log through the block cache
+// a block is decompressed once, when it is brought into the cache
+int lfs_read_block(int addr, int size, char* buffer) {
+  char* data = lfs_cache_get(addr);
+  if (data == NULL) {
+    data = lfs_cache_put(addr);
+    if (lfs_load_block(addr, size, data) == -1) {
+      lfs_cache_drop(addr);
+      return -1;
+    }
+  }
+  memcpy(buffer, data, MFS_BLOCK_SIZE);
+  return 0;
+}
+
+
+// method to read a block taking size bytes at addr in the log, bypassing the cache
+int lfs_load_block(int addr, int size, char* buffer) {
+  if (size <= 0 || size > MFS_BLOCK_SIZE) return -1; // corrupt inode, block cannot take size bytes
+  if (size == MFS_BLOCK_SIZE) {
+    lseek(fs_image, addr, SEEK_SET);
+    read(fs_image, buffer, MFS_BLOCK_SIZE);
+    return 0;
+  }
+  char packed[MFS_BLOCK_SIZE];
+  lseek(fs_image, addr, SEEK_SET);
+  read(fs_image, packed, size);
+  return lfs_unpack_block(packed, size, buffer);
+}
+
+
+// method to turn the size bytes of a block as stored in the log back into the block
+int lfs_unpack_block(char* stored, int size, char* buffer) {
+  if (size <= 0 || size > MFS_BLOCK_SIZE) return -1; // corrupt inode
+  if (size == MFS_BLOCK_SIZE) {
+    memcpy(buffer, stored, MFS_BLOCK_SIZE);
+    return 0;
+  }
+  long long start = lfs_cpu_ns();
+  int unpacked_size = LZ_Decompress(stored, size, buffer, MFS_BLOCK_SIZE);
+  stats.decompress_ns += lfs_cpu_ns() - start;
+  stats.decompressed_blocks++;
+  return (unpacked_size == MFS_BLOCK_SIZE) ? 0 : -1;
+}
+
+
+// method to get the cpu time used by the calling thread, in nanoseconds
+long long lfs_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// method to find how many leading bytes of a block hold data, the rest being zeros
+// or, in a directory, unused entries
+int lfs_block_used(int type, char* buffer) {
+  if (type == MFS_DIRECTORY) {
+    MFS_DirBlock_t* dir_block = (MFS_DirBlock_t*)buffer;
+    for (int j = MFS_MAX_ENTRIES_PER_DIR - 1; j >= 0; j--)
+      if (dir_block->DirEntry[j].inum != -1) return (j + 1) * sizeof(MFS_DirEnt_t);
+    return 0;
+  }
+  for (int i = MFS_BLOCK_SIZE - 1; i >= 0; i--)
+    if (buffer[i] != 0) return i + 1;
+  return 0;
+}
+
+
+// method to write the checkpoint region and make the changes durable, by a local fsync
+// or, with sync replication, by every follower having applied them
+int lfs_commit() {
+  lseek(fs_image, 0, SEEK_SET);
+  write(fs_image, CR, sizeof(MFS_CR_t));
+  commit_seq++;
+  if (sync_replication == 1 && lfs_replicate() == 0) return 0;
+  fsync(fs_image); // commit changes to disk after write
+  return 0;
+}
+
+
+// method to ship the log past each follower's end to it, followed by the checkpoint region
+// returns 0 if every follower has applied the latest commit, -1 otherwise
+int lfs_replicate() {
+
+  int all_acked = 0;
+  for (int i = 0; i < num_followers; i++) {
+    Follower* f = &followers[i];
+    if (f->acked == commit_seq) continue; // up to date
+    if (f->down != 0 && time(NULL) - f->down < MFS_FOLLOWER_RETRY) {
+      all_acked = -1; // give a follower that stopped answering some time before trying again
+      continue;
+    }
+
+    Packet send_packet, return_packet;
+    while (f->acked != commit_seq) {
+      int seq = commit_seq;
+      if (f->received != -1 && f->received < CR->end_of_log) {
+        // ship the next piece of the log, at most one block per packet
+        send_packet.request = REPLICATE;
+        send_packet.offset = f->received;
+        send_packet.length = CR->end_of_log - f->received;
+        if (send_packet.length > MFS_BLOCK_SIZE) send_packet.length = MFS_BLOCK_SIZE;
+        lseek(fs_image, send_packet.offset, SEEK_SET);
+        read(fs_image, send_packet.buffer, send_packet.length);
+      }
+      else {
+        // follower holds the whole log, ship the checkpoint region; one that has not answered
+        // yet may hold a longer log from before a crash, so it first gets the region this
+        // primary started with and cuts back to it
+        MFS_CR_t* cr = (f->received == -1) ? &boot_cr : CR;
+        send_packet.request = CHECKPOINT;
+        send_packet.offset = cr->end_of_log;
+        memcpy(send_packet.buffer, cr, sizeof(MFS_CR_t));
+      }
+      // a follower's scheduler tells retransmissions apart from new packets by client and seq
+      send_packet.client = 0;
+      send_packet.seq = ++rep_seq;
+
+      if (lfs_follower_rpc(f, &send_packet, &return_packet) == -1 || return_packet.return_val == -1) {
+        f->down = time(NULL);
+        all_acked = -1;
+        break;
+      }
+      f->down = 0;
+      f->received = return_packet.return_val; // follower answers with the bytes of log it holds
+      if (f->received > CR->end_of_log) f->received = CR->end_of_log; // bytes past our log are not ours
+      if (send_packet.request == CHECKPOINT && send_packet.offset == CR->end_of_log &&
+          f->received == CR->end_of_log) f->acked = seq;
+    }
+  }
+  return all_acked;
+}
+
+
+// method to send a packet to a follower and wait for its ack, retrying a few times
+int lfs_follower_rpc(Follower* f, Packet* send_packet, Packet* return_packet) {
+
+  fd_set rfds;
+  struct timeval tv;
+  struct sockaddr_in return_addr;
+
+  for (int attempt = 0; attempt < 3; attempt++) {
+    UDP_Write(rep_fd, &f->addr, (char*)send_packet, sizeof(Packet));
+    tv.tv_sec = 0;
+    tv.tv_usec = 200000;
+    FD_ZERO(&rfds);
+    FD_SET(rep_fd, &rfds);
+    while (select(rep_fd+1, &rfds, NULL, NULL, &tv) > 0) {
+      if (UDP_Read(rep_fd, &return_addr, (char*)return_packet, sizeof(Packet)) < 1) break;
+      // drop acks of earlier retransmissions
+      if (return_packet->request == send_packet->request && return_packet->offset == send_packet->offset)
+        return 0;
+      FD_ZERO(&rfds);
+      FD_SET(rep_fd, &rfds);
+    }
+  }
+  return -1;
+}
+
 
-  if (pinum < 0 || pinum >= MFS_INODE_NUM) return -1; // check if pinum is valid
-  if (CR->imap[pinum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if parent imap piece exists
+// method used by a follower to response to replicate requests
+// writes a piece of the primary's log, returns the bytes of log now held
+int lfs_apply(int offset, char* buffer, int length) {
 
-  // find imap piece for parent inode
-  int pimap_piece_addr =  CR->imap[pinum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (pimap_piece_addr == -1) return -1; // check if imap piece for parent inode exists
-  MFS_ImapPiece_t pimap_piece;
-  lseek(fs_image, pimap_piece_addr, SEEK_SET);
-  read(fs_image, &pimap_piece, sizeof(MFS_ImapPiece_t));
+  if (offset < (int)sizeof(MFS_CR_t) || length < 0 || length > MFS_BLOCK_SIZE) return -1;
+  if (offset > received) return received; // a piece is missing, have the primary resend from there
+
+  lseek(fs_image, offset, SEEK_SET);
+  write(fs_image, buffer, length);
+  if (offset + length > received) received = offset + length;
+
+  // drop cached blocks overlapping the piece, they may hold what was there before
+  for (int i = 0; i < MFS_CACHE_BLOCK_NUM; i++) {
+    if (cache[i].addr != -1 && cache[i].addr < offset + length && cache[i].addr + MFS_BLOCK_SIZE > offset)
+      lfs_cache_drop(cache[i].addr);
+  }
+
+  return received;
+}
+
+
+// method used by a follower to response to checkpoint requests
+// makes the shipped log visible once all of it has arrived and drops any log past it,
+// returns the bytes of log held
+int lfs_checkpoint(MFS_CR_t* cr) {
+
+  if (cr->magic != MFS_IMAGE_MAGIC || cr->version != MFS_IMAGE_VERSION) return -1; // primary writes another format
+  if (cr->shard != CR->shard) return -1; // primary serves another shard
+  if (cr->end_of_log > received) return received; // not all of the log has arrived yet
+
+  // readers see the new imap at once since the old one's blocks are never overwritten
+  memcpy(CR, cr, sizeof(MFS_CR_t));
+  lseek(fs_image, 0, SEEK_SET);
+  write(fs_image, CR, sizeof(MFS_CR_t));
+
+  // a restarted primary may have lost the tail of its log, what lies past its end is
+  // not part of it and gets overwritten by what the primary ships next
+  if (received > CR->end_of_log) {
+    received = CR->end_of_log;
+    ftruncate(fs_image, received);
+  }
+
+  return received;
+}
+
+
+// method used to response to lookup requests
+int lfs_lookup(int pinum, char* name) {
 
   // find parent inode
-  int pinode_addr = pimap_piece.inodes[pinum % MFS_IMAP_PIECE_INODE_NUM]; // get address of parent inode with given inum
-  if(pinode_addr == -1) return -1; // check if parent inode exists
   MFS_Inode_t pinode;
-  lseek(fs_image, pinode_addr, SEEK_SET);
-  read(fs_image, &pinode, sizeof(MFS_Inode_t));
+  if (lfs_find_inode(pinum, &pinode) == -1) return -1; // check if parent inode exists
 
   // make sure given parent inode is a directory
   if (pinode.type != MFS_DIRECTORY) return -1;
-  
+
+  // entries hold live inums, within a snapshot they are tagged with its id
+  int snap = MFS_SNAPSHOT_OF(pinum);
   for(int i = 0; i < MFS_INODE_BLOCK_NUM; i++) {
-    int dir_addr = pinode.data[i]; // get address of parent directory
-    if(dir_addr == -1) return -1; // check if given parent directory is empty
     // read data from given parent directory
     MFS_DirBlock_t pdir_block;
-    lseek(fs_image, dir_addr, SEEK_SET);
-    read(fs_image, &pdir_block, MFS_BLOCK_SIZE);
+    if (lfs_get_block(&pinode, i, (char*)&pdir_block) == -1) return -1; // check if given parent directory is empty
     // search for given name
     for(int j = 0; j < MFS_MAX_ENTRIES_PER_DIR; j++) {
       MFS_DirEnt_t cur_entry = pdir_block.DirEntry[j];
       if (cur_entry.inum == -1) continue; // skip empty DirEntry
       if (strcmp(cur_entry.name, name) == 0)
-        return cur_entry.inum;
+        return MFS_SNAPSHOT_INUM(snap, cur_entry.inum);
     }
   }
   return -1; // return -1 if not found after looping over all DirEntry in the directory
 }
 
 
-// method used to response to stat requests
-int lfs_stat(int inum, MFS_Stat_t* m) {
+// method used to response to lookup path requests
+// walks the path from pinum while it stays on this shard, storing the inum of each resolved
+// component in inums; returns the last inum reached (for the client to go on from on
+// another shard if the path is not done) or -1 if a component does not exist
+int lfs_lookup_path(int pinum, char* path, int* inums, int* resolved) {
 
-  if (inum < 0 || inum >= MFS_INODE_NUM) return -1; // check if inum is valid
-  if (CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if imap piece exists
+  *resolved = 0;
+  int inum = pinum;
+  char* name = path;
+  while (1) {
+    while (*name == '/') name++; // skip empty components
+    if (*name == '\0') return inum; // whole path resolved
+    if (MFS_SHARD_OF(inum) != CR->shard) return inum; // rest of the path starts on another shard
+    if (*resolved == MFS_BLOCK_SIZE / sizeof(int)) return inum; // no room left for more inums
+
+    // cut the next component out of the path
+    int len_name = 0;
+    while (name[len_name] != '\0' && name[len_name] != '/') len_name++;
+    if (len_name > 27) return -1; // too long, no such name
+    char component[28];
+    memcpy(component, name, len_name);
+    component[len_name] = '\0';
+    name += len_name;
+
+    inum = lfs_lookup(inum, component);
+    if (inum == -1) return -1;
+    inums[(*resolved)++] = inum;
+  }
+}
 
-  // find imap piece
-  int imap_piece_addr = CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (imap_piece_addr == -1) return -1; // check if imap piece exists
-  MFS_ImapPiece_t imap_piece;
-  lseek(fs_image, imap_piece_addr, SEEK_SET);
-  read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
+
+// method used to response to stat requests
+int lfs_stat(int inum, MFS_Stat_t* m) {
 
   // find inode
-  int inode_addr = imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
-  if (inode_addr == -1) return -1; // check if inode exists
   MFS_Inode_t inode;
-  lseek(fs_image, inode_addr, SEEK_SET);
-  read(fs_image, &inode, sizeof(MFS_Inode_t));
+  if (lfs_find_inode(inum, &inode) == -1) return -1; // check if inode exists
 
   // get inode stat
   m->size = inode.size;
@@ -204,40 +1177,71 @@ int lfs_stat(int inum, MFS_Stat_t* m) {
 }
 
 
+// method used to response to readdir requests
+// packs up to max used entries from slot cursor on into buffer, followed by their stat if plus
+// is set (type -1 for an entry on another shard); returns the num of entries and sets next to
+// the slot to go on from, -1 once the whole directory is listed
+int lfs_readdir(int inum, int cursor, int max, int plus, char* buffer, int* next) {
+
+  // find inode
+  MFS_Inode_t inode;
+  if (lfs_find_inode(inum, &inode) == -1) return -1; // check if inode exists
+  if (inode.type != MFS_DIRECTORY) return -1; // make sure given inode is a directory
+  if (cursor < 0) return -1; // check if cursor is valid
+
+  // as many entries as fit in one packet
+  int fit = MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t);
+  if (plus) fit = MFS_BLOCK_SIZE / (sizeof(MFS_DirEnt_t) + sizeof(MFS_Stat_t));
+  if (max > fit) max = fit;
+
+  MFS_DirEnt_t* entries = (MFS_DirEnt_t*)buffer;
+  MFS_Stat_t entry_stats[MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)];
+  MFS_DirBlock_t dir_block;
+  int count = 0;
+  int slot = cursor;
+  int last = MFS_INODE_BLOCK_NUM * MFS_MAX_ENTRIES_PER_DIR;
+  while (slot < last && count < max) {
+    int i = slot / MFS_MAX_ENTRIES_PER_DIR;
+    if (lfs_get_block(&inode, i, (char*)&dir_block) == -1) {
+      slot = (i + 1) * MFS_MAX_ENTRIES_PER_DIR; // skip unused directory block
+      continue;
+    }
+    // take the used entries of this block
+    for (int j = slot % MFS_MAX_ENTRIES_PER_DIR; j < MFS_MAX_ENTRIES_PER_DIR && count < max; j++) {
+      slot = i * MFS_MAX_ENTRIES_PER_DIR + j + 1;
+      if (dir_block.DirEntry[j].inum == -1) continue; // skip empty DirEntry
+      entries[count] = dir_block.DirEntry[j];
+      entries[count].inum = MFS_SNAPSHOT_INUM(MFS_SNAPSHOT_OF(inum), entries[count].inum); // as lookup does
+      if (plus && lfs_stat(entries[count].inum, &entry_stats[count]) == -1)
+        entry_stats[count].type = -1; // lives on another shard, the client stats it there
+      count++;
+    }
+  }
+  if (plus) memcpy(buffer + count * sizeof(MFS_DirEnt_t), entry_stats, count * sizeof(MFS_Stat_t));
+
+  *next = (slot < last) ? slot : -1;
+  return count;
+}
+
+
 // method used to response to write requests
 int lfs_write(int inum, char* buffer, int block) {
 
-  if (inum < 0 || inum >= MFS_INODE_NUM) return -1; // check if inum is valid
   if (block < 0 || block > MFS_INODE_BLOCK_NUM-1)  return -1; // check if block is valid
-  if (CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if imap piece exists
-
-  // find imap piece
-  int imap_piece_addr =  CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (imap_piece_addr == -1) return -1; // check if imap piece exists
-  MFS_ImapPiece_t imap_piece;
-  lseek(fs_image, imap_piece_addr, SEEK_SET);
-  read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
 
   // find inode
-  int inode_addr = imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
-  if (inode_addr == -1) return -1; // check if inode exists
+  inum = lfs_local_inum(inum);
   MFS_Inode_t inode;
-  lseek(fs_image, inode_addr, SEEK_SET);
-  read(fs_image, &inode, sizeof(MFS_Inode_t));
+  if (lfs_get_inode(inum, &inode) == -1) return -1; // check if inode exists
   if (inode.type != MFS_REGULAR_FILE) return -1; // make sure given inode points to regular file
-  
-  // write data to end of log and update given inode block pointer
-  int block_addr = CR->end_of_log;
-  inode.data[block] = block_addr;
-  lseek(fs_image, block_addr, SEEK_SET);
-  write(fs_image, buffer, MFS_BLOCK_SIZE);
-  CR->end_of_log += MFS_BLOCK_SIZE;
+
+  // write data to end of log (or inline) and update given inode block pointer
+  lfs_set_block(&inode, block, buffer);
   inode.size = (block + 1) * MFS_BLOCK_SIZE;
 
-  // update inode in the file system image after write
-  lseek(fs_image, inode_addr, SEEK_SET);
-  write(fs_image, &inode, sizeof(MFS_Inode_t));
-  fsync(fs_image); // commit changes to disk after write
+  // add the new version of the inode to the log after write
+  lfs_put_inode(inum, &inode);
+  lfs_commit(); // commit changes to disk after write
 
   return 0;
 }
@@ -246,28 +1250,134 @@ int lfs_write(int inum, char* buffer, int block) {
 // method used to response to read requests
 int lfs_read(int inum, char* buffer, int block) {
 
-  if (inum < 0 || inum >= MFS_INODE_NUM) return -1; // check if inum is valid
   if (block < 0 || block > MFS_INODE_BLOCK_NUM-1)  return -1; // check if block is valid
-  if (CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if imap piece exists
 
-  // find imap piece
-  int imap_piece_addr = CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (imap_piece_addr == -1) return -1; // check if imap piece exists
-  MFS_ImapPiece_t imap_piece;
-  lseek(fs_image, imap_piece_addr, SEEK_SET);
-  read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
-
-  // find inode
-  int inode_addr = imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
-  if (inode_addr == -1) return -1; // check if inode exists
+  // find inode, live or in a snapshot
   MFS_Inode_t inode;
-  lseek(fs_image, inode_addr, SEEK_SET);
-  read(fs_image, &inode, sizeof(MFS_Inode_t));
- 
-  // read the block
+  if (lfs_find_inode(inum, &inode) == -1) return -1; // check if inode exists
+  inum = MFS_LOCAL_INUM(inum); // a snapshot's inode shares the readahead state of the live one
+
+  // a small file is inline, it came along with its inode
+  if (block == 0 && inode.inline_size >= 0) {
+    stats.reads++;
+    stats.inline_reads++;
+    return lfs_get_block(&inode, 0, buffer);
+  }
   int block_addr = inode.data[block];
-  lseek(fs_image, block_addr, SEEK_SET);
-  read(fs_image, buffer, MFS_BLOCK_SIZE);
+  if (block_addr == -1) return -1; // check if block has been written
+  int cached = (lfs_cache_get(block_addr) != NULL); // before readahead may bring it in
+
+  // follow the access pattern: read further ahead while read ahead blocks get used,
+  // read less ahead when they are skipped
+  Readahead* ra = &inode_readahead[inum];
+  int sequential = (block == ra->next);
+  if (sequential) {
+    if (block < ra->end && ra->depth < MFS_READAHEAD_MAX) ra->depth++; // read ahead block was used
+    if (ra->depth == 0) ra->depth = MFS_READAHEAD_MIN; // reader turned sequential
+  }
+  else {
+    if (ra->end > ra->next) {
+      stats.readahead_wasted += ra->end - ra->next;
+      ra->depth /= 2;
+    }
+    ra->end = 0;
+  }
+  ra->next = block + 1;
+
+  // keep depth blocks read ahead of a sequential reader, in batches of at least half of it
+  // a block not read ahead yet is read along with the batch; nothing past the last
+  // written block is read ahead
+  if (sequential && ra->depth > 0) {
+    int last = MFS_INODE_BLOCK_NUM;
+    while (inode.data[last-1] == -1) last--; // block is written, so last ends up past it
+    int from = ra->end > block ? ra->end : block;
+    int to = block + 1 + ra->depth;
+    if (to > last) to = last;
+    if (from == block || to - from >= (ra->depth + 1) / 2) {
+      lfs_readahead(&inode, from, to);
+      ra->end = to;
+    }
+  }
+
+  // read the block, from the cache if it is there
+  stats.reads++;
+  if (cached) stats.cache_hits++;
+  return lfs_read_block(block_addr, inode.data_size[block], buffer);
+}
+
+
+// method to find a block in the cache, returns its data or NULL if it is not cached
+char* lfs_cache_get(int addr) {
+  for (int i = 0; i < MFS_CACHE_BLOCK_NUM; i++) {
+    if (cache[i].addr == addr) {
+      cache[i].used = ++cache_clock;
+      return cache[i].data;
+    }
+  }
+  return NULL;
+}
+
+
+// method to make room for a block in the cache, returns the data for the caller to fill
+char* lfs_cache_put(int addr) {
+  int victim = 0;
+  for (int i = 0; i < MFS_CACHE_BLOCK_NUM; i++) {
+    if (cache[i].addr == -1) {
+      victim = i;
+      break;
+    }
+    if (cache[i].used < cache[victim].used) victim = i;
+  }
+  cache[victim].addr = addr;
+  cache[victim].used = ++cache_clock;
+  return cache[victim].data;
+}
+
+
+// method to remove a block from the cache
+int lfs_cache_drop(int addr) {
+  for (int i = 0; i < MFS_CACHE_BLOCK_NUM; i++) {
+    if (cache[i].addr == addr) cache[i].addr = -1;
+  }
+  return 0;
+}
+
+
+// method to read blocks from to to of the inode into the cache
+// blocks written one after another lie close in the log, so they are read with one read
+int lfs_readahead(MFS_Inode_t* inode, int from, int to) {
+
+  static char span[MFS_READAHEAD_SPAN];
+  int low = -1, high = -1;
+  for (int b = from; b < to; b++) {
+    int addr = inode->data[b];
+    if (addr == -1 || lfs_cache_get(addr) != NULL) continue; // nothing to read
+    if (inode->data_size[b] <= 0 || inode->data_size[b] > MFS_BLOCK_SIZE) continue; // corrupt, unpacking rejects it
+    if (low == -1 || addr < low) low = addr;
+    if (addr + inode->data_size[b] > high) high = addr + inode->data_size[b];
+  }
+  if (low == -1) return 0; // all blocks already cached
+
+  int batched = (high - low <= MFS_READAHEAD_SPAN);
+  if (batched) {
+    lseek(fs_image, low, SEEK_SET);
+    read(fs_image, span, high - low);
+    stats.readahead_batches++;
+  }
+  for (int b = from; b < to; b++) {
+    int addr = inode->data[b];
+    if (addr == -1 || lfs_cache_get(addr) != NULL) continue;
+    char* data = lfs_cache_put(addr); // blocks are cached decompressed
+    int rc;
+    if (batched) rc = lfs_unpack_block(span + (addr - low), inode->data_size[b], data);
+    else {
+      // blocks are too far apart, read them one by one
+      rc = lfs_load_block(addr, inode->data_size[b], data);
+      stats.readahead_batches++;
+    }
+    if (rc == -1) lfs_cache_drop(addr);
+    stats.readahead_blocks++;
+  }
 
   return 0;
 }
@@ -276,86 +1386,43 @@ int lfs_read(int inum, char* buffer, int block) {
 // method used to response to creat requests
 int lfs_creat(int pinum, int type, char* name) {
 
-  if (pinum < 0 || pinum >= MFS_INODE_NUM) return -1; // check if pinum is valid
-
   // check if given name is too long
   int len_name = 0;
   while (name[len_name] != '\0') len_name++;
   if (len_name > 27) return -1; // too long, creat failed
+  if (lfs_local_inum(pinum) == -1) return -1; // parent is not on this shard or is in a snapshot
 
   // check if name already exists, return success if found
   if (lfs_lookup(pinum, name) != -1) return 0;
 
-  if (CR->imap[pinum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if parent imap piece exists
+  // create the inode on this shard, then add its name to the parent directory
+  int inum = lfs_alloc(pinum, type);
+  if (inum == -1) return -1;
+  if (lfs_link(pinum, name, inum) == -1) {
+    lfs_free(inum, 0); // parent directory is full, release the new inode
+    lfs_commit();
+    return -1;
+  }
 
-  // find parent imap piece
-  int pimap_piece_addr = CR->imap[pinum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (pimap_piece_addr == -1) return -1; // check if imap piece exists
-  MFS_ImapPiece_t pimap_piece;
-  lseek(fs_image, pimap_piece_addr, SEEK_SET);
-  read(fs_image, &pimap_piece, sizeof(MFS_ImapPiece_t));
+  lfs_commit(); // commit changes to disk after write
 
-  // find parent inode
-  int pinode_addr = pimap_piece.inodes[pinum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
-  if(pinode_addr == -1) return -1; // check if inode exists
-  MFS_Inode_t pinode;
-  lseek(fs_image, pinode_addr, SEEK_SET);
-  read(fs_image, &pinode, sizeof(MFS_Inode_t));
+  return 0;
+}
 
-  // make sure given parent inode is a directory
-  if (pinode.type != MFS_DIRECTORY) return -1;
 
-  // check if parent directory is full
-  int full_parent_directory = 1;
-  for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++) {
-    if (full_parent_directory == 0) break;
-    int dir_addr = pinode.data[i]; // get address of parent directory block
-    if(dir_addr == -1) {
-      full_parent_directory = 0;
-      break;
-    }
-    MFS_DirBlock_t pdir_block;
-    lseek(fs_image, dir_addr, SEEK_SET);
-    read(fs_image, &pdir_block, MFS_BLOCK_SIZE);
-    // search for empty entry
-    for(int j = 0; j < MFS_MAX_ENTRIES_PER_DIR; j++) {
-      if (pdir_block.DirEntry[j].inum == -1) {
-        full_parent_directory = 0;
-        break;
-      }
-    }
-  }
-  if (full_parent_directory == 1) return -1; // given parent directory is full, fail
+// method used to response to alloc requests and by creat
+// allocates an inode (and its first directory block) without naming it, returns its global inum
+int lfs_alloc(int pinum, int type) {
 
- 
-  // create an inode for name at end_of_log
-  MFS_Inode_t new_inode;
-  new_inode.type = type;
-  new_inode.size = 0;
-  for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++) 
-    new_inode.data[i] = -1; 
-  // add new inode to file system image
-  lseek(fs_image, CR->end_of_log, SEEK_SET);
-  write(fs_image, &new_inode, sizeof(MFS_Inode_t));
-  int new_inode_addr = CR->end_of_log;
-  CR->end_of_log += sizeof(MFS_Inode_t); // update CR->end_of_log for future lseek
-
-  // update imap corresponding to the creation
+  if (pinum < 0 || MFS_SNAPSHOT_OF(pinum) != 0) return -1; // check if pinum is valid, parent may live on another shard
+  if (type != MFS_DIRECTORY && type != MFS_REGULAR_FILE) return -1; // check if type is valid
+
+  // find an unused inum in the imap
   int new_inode_num = -1;
-  int added = 0; // variable to check whether new_inode has been added to imap
-  for(int i = 0; i < MFS_IMAP_PIECE_NUM; i++){
-    if (added == 1) break; // check if already added
+  for(int i = 0; i < MFS_IMAP_PIECE_NUM && new_inode_num == -1; i++){
     int imap_piece_addr = CR->imap[i];
     if (imap_piece_addr == -1) { // case when new piece of imap should be initialized
       new_inode_num = i * MFS_IMAP_PIECE_INODE_NUM;
-      MFS_ImapPiece_t new_imap_piece;
-      new_imap_piece.inodes[0] = new_inode_addr;
-      for (int k = 1; k < MFS_IMAP_PIECE_INODE_NUM; k++)
-        new_imap_piece.inodes[k] = -1;
-      lseek(fs_image, CR->end_of_log, SEEK_SET);
-      write(fs_image, &new_imap_piece, sizeof(MFS_ImapPiece_t));
-      CR->imap[i] = CR->end_of_log; // update imap
-      CR->end_of_log += sizeof(MFS_ImapPiece_t);  
       break;
     }
     MFS_ImapPiece_t imap_piece;
@@ -363,118 +1430,148 @@ int lfs_creat(int pinum, int type, char* name) {
     read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
     for(int j = 0; j < MFS_IMAP_PIECE_INODE_NUM; j++) {
       if (imap_piece.inodes[j] != -1) continue; // find empty entry
-      imap_piece.inodes[j] = new_inode_addr;
       new_inode_num = i * MFS_IMAP_PIECE_INODE_NUM + j;
-      lseek(fs_image, imap_piece_addr, SEEK_SET);
-      write(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
-      added = 1; // added
       break;
     }
   }
+  if (new_inode_num == -1) return -1; // imap is full
+  memset(&inode_readahead[new_inode_num], 0, sizeof(Readahead)); // forget the previous owner's reads
+
+  // create an inode for name
+  MFS_Inode_t new_inode;
+  new_inode.type = type;
+  new_inode.size = 0;
+  new_inode.inline_size = -1;
+  for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++)
+    new_inode.data[i] = -1;
 
-  // create a new directory block at end_of_log if type is MFS_DIRECTORY
+  // create a new directory block if type is MFS_DIRECTORY, it starts out inline
   if (type == MFS_DIRECTORY){
     // initialize directory
     MFS_DirBlock_t new_dir;
     strcpy(new_dir.DirEntry[0].name, ".\0");
-    new_dir.DirEntry[0].inum = new_inode_num;
+    new_dir.DirEntry[0].inum = MFS_GLOBAL_INUM(CR->shard, new_inode_num); // directory entries hold global inums
     strcpy(new_dir.DirEntry[1].name, "..\0");
     new_dir.DirEntry[1].inum = pinum;
     for(int i = 2; i < MFS_MAX_ENTRIES_PER_DIR; i++)
       new_dir.DirEntry[i].inum = -1;
-    // add new directory block to file system image
-    lseek(fs_image, CR->end_of_log, SEEK_SET);
-    write(fs_image, &new_dir, sizeof(MFS_DirBlock_t));
-    CR->end_of_log += sizeof(MFS_DirBlock_t); // update CR->end_of_log for future lseek
-    // update new_inode in file system image
-    new_inode.data[0] = CR->end_of_log - sizeof(MFS_DirBlock_t);
+    lfs_set_block(&new_inode, 0, (char*)&new_dir);
     new_inode.size = MFS_BLOCK_SIZE;
-    lseek(fs_image, new_inode_addr, SEEK_SET);
-    write(fs_image, &new_inode, sizeof(MFS_Inode_t));
-  } 
+  }
+
+  // add new inode to the log and the imap
+  lfs_put_inode(new_inode_num, &new_inode);
+
+  return MFS_GLOBAL_INUM(CR->shard, new_inode_num);
+}
+
+
+// method used to response to link requests and by creat
+// adds name for the inode inum (possibly on another shard) to the parent directory
+int lfs_link(int pinum, char* name, int inum) {
+
+  if (inum < 0 || MFS_SNAPSHOT_OF(inum) != 0) return -1; // check if inum is valid
+
+  // check if given name is too long
+  int len_name = 0;
+  while (name[len_name] != '\0') len_name++;
+  if (len_name > 27) return -1; // too long, link failed
+
+  // check if name already exists, a retransmitted link finds its own name there
+  int existing = lfs_lookup(pinum, name);
+  if (existing == inum) return 0;
+  if (existing != -1) return -1;
+
+  // find parent inode
+  pinum = lfs_local_inum(pinum);
+  MFS_Inode_t pinode;
+  if (lfs_get_inode(pinum, &pinode) == -1) return -1; // check if parent inode exists
+
+  // make sure given parent inode is a directory
+  if (pinode.type != MFS_DIRECTORY) return -1;
 
   // add name to parent directory
-  added = 0; // variable to check whether name has been added to parent directory
   for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++) {
-    if (added == 1) break; // check if already added
-    int dir_addr = pinode.data[i]; // get address of parent directory block
-    if(dir_addr == -1) { // case all previous blocks are filled
-      // create a new block of parent direcotry at end_of_log
-      MFS_DirBlock_t new_dirBlock;
-      new_dirBlock.DirEntry[0].inum = new_inode_num;
-      strcpy(new_dirBlock.DirEntry[0].name, name);
-      for(int k = 1; k < MFS_MAX_ENTRIES_PER_DIR; k++)
-        new_dirBlock.DirEntry[k].inum = -1;
-      lseek(fs_image, CR->end_of_log, SEEK_SET);
-      write(fs_image, &new_dirBlock, sizeof(MFS_DirBlock_t));
-      CR->end_of_log += sizeof(MFS_DirBlock_t);
-      // update pinode into file system image
-      pinode.data[i] = CR->end_of_log - sizeof(MFS_DirBlock_t); 
-      pinode.size += MFS_BLOCK_SIZE;
-      lseek(fs_image, pinode_addr, SEEK_SET);
-      write(fs_image, &pinode, sizeof(MFS_Inode_t));
-      break;
-    }
     // read data from given parent directory
     MFS_DirBlock_t pdir_block;
-    lseek(fs_image, dir_addr, SEEK_SET);
-    read(fs_image, &pdir_block, MFS_BLOCK_SIZE);
+    if (lfs_get_block(&pinode, i, (char*)&pdir_block) == -1) { // case all previous blocks are filled
+      // create a new block of parent direcotry
+      for(int k = 0; k < MFS_MAX_ENTRIES_PER_DIR; k++)
+        pdir_block.DirEntry[k].inum = -1;
+      pinode.size += MFS_BLOCK_SIZE;
+    }
     // creat name-inum pair in given parent directory's empty entry
     for(int j = 0; j < MFS_MAX_ENTRIES_PER_DIR; j++) {
       if (pdir_block.DirEntry[j].inum == -1){
-        pdir_block.DirEntry[j].inum = new_inode_num;
+        pdir_block.DirEntry[j].inum = inum;
         strcpy(pdir_block.DirEntry[j].name, name);
-        // update parent directory to file system image
-        lseek(fs_image, dir_addr, SEEK_SET);
-        write(fs_image, &pdir_block, sizeof(MFS_DirBlock_t));
-        added = 1; // added
-        break;
+        // add new version of the directory block and of the parent inode to the log
+        lfs_set_block(&pinode, i, (char*)&pdir_block);
+        lfs_put_inode(pinum, &pinode);
+        return 0;
       }
     }
   }
 
-  // update checkpoint region after change in imap and end_of_log
-  lseek(fs_image, 0, SEEK_SET);
-  write(fs_image, CR, sizeof(MFS_CR_t));
-
-  fsync(fs_image); // commit changes to disk after write
-
-  return 0;
+  return -1; // given parent directory is full, fail
 }
 
 
 // method used to response to unlink requests
 int lfs_unlink(int pinum, char* name){
 
-  if (pinum < 0 || pinum >= MFS_INODE_NUM) return -1; // check if pinum is valid
-  
+  if (lfs_local_inum(pinum) == -1) return -1; // parent is not on this shard or is in a snapshot
   int inum = lfs_lookup(pinum, name); // get inum with lookup
   if (inum == -1) return 0; // if inum does not exist, return 0 and do nothing
 
-  if (CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] == -1) return -1; // check if imap piece exists
+  // release the inode if it lives here, a child on another shard is freed by the client
+  // once its name is gone
+  if (MFS_SHARD_OF(inum) == CR->shard && lfs_free(inum, 0) == -1) return -1;
 
-  // find imap piece
-  int imap_piece_addr =  CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  if (imap_piece_addr == -1) return -1; // check if imap piece exists
-  MFS_ImapPiece_t imap_piece;
-  lseek(fs_image, imap_piece_addr, SEEK_SET);
-  read(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
+  // valid to unlink, set inum to -1 in parent directory
+  pinum = lfs_local_inum(pinum);
+  MFS_Inode_t pinode;
+  lfs_get_inode(pinum, &pinode);
+
+  for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++){
+    // read data from given parent directory
+    MFS_DirBlock_t pdir_block;
+    if (lfs_get_block(&pinode, i, (char*)&pdir_block) == -1) continue;
+    // search for given name
+    for(int j = 0; j < MFS_MAX_ENTRIES_PER_DIR; j++) {
+      if (pdir_block.DirEntry[j].inum == -1) continue; // skip empty DirEntry
+      if (strcmp(pdir_block.DirEntry[j].name, name) == 0){
+	pdir_block.DirEntry[j].inum = -1; // unlink
+        strcpy(pdir_block.DirEntry[j].name, "\0");
+        // add new version of the directory block and of the parent inode to the log
+        lfs_set_block(&pinode, i, (char*)&pdir_block);
+        lfs_put_inode(pinum, &pinode);
+        break;
+      }
+    }
+  }
+
+  lfs_commit(); // commit changes to disk after write
+
+  return 0;
+}
+
+
+// method used to response to free requests and by unlink
+// removes the inode from the imap, fails if it is a non-empty directory; with check set
+// nothing is removed, it only tells whether the inode could be freed
+int lfs_free(int inum, int check) {
 
   // find inode
-  int inode_addr = imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM]; // get address of inode with given inum
-  if (inode_addr == -1) return -1; // check if inode exists
+  inum = lfs_local_inum(inum);
   MFS_Inode_t inode;
-  lseek(fs_image, inode_addr, SEEK_SET);
-  read(fs_image, &inode, sizeof(MFS_Inode_t));
+  if (lfs_get_inode(inum, &inode) == -1) return -1; // check if inode exists
 
   // if inode to unlink points to a directory, check if directory is empty
-  if (inode.type == MFS_DIRECTORY){ 
+  if (inode.type == MFS_DIRECTORY){
     for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++){
-      int dir_addr = inode.data[i];
-      if (dir_addr == -1) continue;
       MFS_DirBlock_t dir_block;
-      lseek(fs_image, dir_addr, SEEK_SET);
-      read(fs_image, &dir_block, MFS_BLOCK_SIZE);
+      if (lfs_get_block(&inode, i, (char*)&dir_block) == -1) continue;
       int j = 0;
       if (i == 0) j = 2; // skip . and ..
       for(int k = j; k < MFS_MAX_ENTRIES_PER_DIR; k++) {
@@ -482,84 +1579,176 @@ int lfs_unlink(int pinum, char* name){
       }
     }
   }
+  if (check == 1) return 0; // only asked whether the inode could go
 
-  // valid to unlink, set inum to -1 in parent directory and imap
-  // find imap piece for parent inode
-  int pimap_piece_addr = CR->imap[pinum / MFS_IMAP_PIECE_INODE_NUM]; // get address of corresponding imap piece
-  MFS_ImapPiece_t pimap_piece;
-  lseek(fs_image, pimap_piece_addr, SEEK_SET);
-  read(fs_image, &pimap_piece, sizeof(MFS_ImapPiece_t));
+  // remove inode from the imap
+  lfs_put_inode(inum, NULL);
 
-  // find parent inode
-  int pinode_addr = pimap_piece.inodes[pinum % MFS_IMAP_PIECE_INODE_NUM]; // get address of parent inode with given inum
-  MFS_Inode_t pinode;
-  lseek(fs_image, pinode_addr, SEEK_SET);
-  read(fs_image, &pinode, sizeof(MFS_Inode_t));
+  return 0;
+}
 
-  for (int i = 0; i < MFS_INODE_BLOCK_NUM; i++){
-    int dir_addr = pinode.data[i]; // get address of parent directory
-    // read data from given parent directory
-    MFS_DirBlock_t pdir_block;
-    lseek(fs_image, dir_addr, SEEK_SET);
-    read(fs_image, &pdir_block, MFS_BLOCK_SIZE);
-    // search for given name
-    for(int j = 0; j < MFS_MAX_ENTRIES_PER_DIR; j++) {
-      if (pdir_block.DirEntry[j].inum == -1) continue; // skip empty DirEntry
-      if (strcmp(pdir_block.DirEntry[j].name, name) == 0){
-	pdir_block.DirEntry[j].inum = -1; // unlink
-        strcpy(pdir_block.DirEntry[j].name, "\0");
-        // update parent directory in file system image
-        lseek(fs_image, dir_addr, SEEK_SET);
-        write(fs_image, &pdir_block, sizeof(MFS_DirBlock_t));
-        break;
-      }
-    }
+
+// method used to response to snapshot requests
+// freezes a copy of the imap in the log as snapshot snap, the client picks snap so that
+// it is the same on every shard; nothing else is copied, the log it points to is never
+// overwritten; returns the snapshot id
+int lfs_snapshot(int snap) {
+
+  if (snap < 1 || snap > MFS_MAX_SNAPSHOTS || CR->snapshots[snap-1].id != 0) return -1; // check if snap is free
+
+  MFS_Snapshot_t* s = &CR->snapshots[snap-1];
+  s->imap = lfs_append(CR->imap, sizeof(CR->imap));
+  s->end_of_log = CR->end_of_log;
+  s->time = time(NULL);
+  s->id = snap;
+  lfs_commit(); // commit changes to disk after write
+
+  return snap;
+}
+
+
+// method used to response to snapshot list requests
+// packs the snapshots kept into buffer, returns their num
+int lfs_snapshot_list(char* buffer) {
+  int count = 0;
+  for (int i = 0; i < MFS_MAX_SNAPSHOTS; i++) {
+    if (CR->snapshots[i].id == 0) continue; // skip unused slot
+    memcpy(buffer + count * sizeof(MFS_Snapshot_t), &CR->snapshots[i], sizeof(MFS_Snapshot_t));
+    count++;
   }
-  
-  // change imap and imap piece corresponding to the unlink
-  imap_piece.inodes[inum % MFS_IMAP_PIECE_INODE_NUM] = -1;
-  // update imap piece in file system image
-  lseek(fs_image, imap_piece_addr, SEEK_SET);
-  write(fs_image, &imap_piece, sizeof(MFS_ImapPiece_t));
+  return count;
+}
 
-  // check if imap piece is empty after unlink
-  int empty_piece = 1; // 1 stand for empty imap piece
-  for(int i = 0; i < MFS_IMAP_PIECE_INODE_NUM; i++){
-    if (imap_piece.inodes[i] != -1) {
-      empty_piece = 0; // 0 stand for not empty imap piece
-      break;
-    }
+
+// method used to response to snapshot delete requests
+// the snapshot's blocks stay in the log, there is no cleaner to reclaim them
+int lfs_snapshot_delete(int snap) {
+  if (snap < 1 || snap > MFS_MAX_SNAPSHOTS || CR->snapshots[snap-1].id == 0) return -1; // check if snapshot exists
+  CR->snapshots[snap-1].id = 0;
+  lfs_commit(); // commit changes to disk after write
+  return 0;
+}
+
+
+// method to print the server's counters
+int lfs_print_stats() {
+  printf("reads: %d, cache hits: %d, inline: %d\n", stats.reads, stats.cache_hits, stats.inline_reads);
+  printf("readahead: %d blocks in %d reads, %d wasted\n",
+         stats.readahead_blocks, stats.readahead_batches, stats.readahead_wasted);
+  if (stats.raw_bytes > 0) {
+    int offered = stats.raw_bytes / MFS_BLOCK_SIZE;
+    printf("compression: %d of %d blocks, %lld -> %lld bytes (ratio %.2f), %.1f us per block\n",
+           stats.compressed_blocks, offered, stats.raw_bytes, stats.stored_bytes,
+           (double)stats.raw_bytes / stats.stored_bytes, stats.compress_ns / 1000.0 / offered);
   }
-  if (empty_piece == 1) {
-    // imap piece becomes empty after unlink, update
-    CR->imap[inum / MFS_IMAP_PIECE_INODE_NUM] = -1;
-    lseek(fs_image, 0, SEEK_SET);
-    write(fs_image, CR, sizeof(MFS_CR_t));
+  if (stats.decompressed_blocks > 0)
+    printf("decompression: %d blocks, %.1f us per block\n",
+           stats.decompressed_blocks, stats.decompress_ns / 1000.0 / stats.decompressed_blocks);
+
+  // latency percentiles are bounded by the bucket they fall in
+  char* class_names[MFS_NUM_CLASSES] = {"metadata", "reads", "writes"};
+  for (int k = 0; k < MFS_NUM_CLASSES; k++) {
+    if (stats.served[k] == 0) continue;
+    int p50 = -1, p99 = -1, seen = 0;
+    for (int b = 0; b < MFS_LATENCY_BUCKETS; b++) {
+      seen += stats.latency[k][b];
+      if (p50 == -1 && seen * 100 >= stats.served[k] * 50) p50 = b;
+      if (p99 == -1 && seen * 100 >= stats.served[k] * 99) p99 = b;
+    }
+    printf("%s: %d requests, p50 < %d us, p99 < %d us\n", class_names[k], stats.served[k], 1 << p50, 1 << p99);
   }
-
-  fsync(fs_image); // commit changes to disk after write
-  
+  if (stats.dropped > 0) printf("dropped: %d requests, all client slots busy\n", stats.dropped);
+  if (stats.retransmissions > 0) printf("dropped: %d retransmissions of queued requests\n", stats.retransmissions);
+  if (stats.over_limit > 0) printf("dropped: %d requests of clients with %d queued\n", stats.over_limit, MFS_MAX_CLIENT_QUEUED);
   return 0;
 }
 
 
 // method to shutdown the server
 int lfs_shutdown() {
+  if (num_followers > 0) lfs_replicate(); // give followers what they miss
   fsync(fs_image); // force file image to disk
+  lfs_print_stats();
   exit(0);
 }
 
 
+// method to parse a comma separated list of host:port followers
+int lfs_add_followers(char* list) {
+  for (char *host = strtok(list, ","); host != NULL; host = strtok(NULL, ",")) {
+    char *colon = strchr(host, ':');
+    if (colon == NULL || num_followers == MFS_MAX_FOLLOWERS) return -1;
+    *colon = '\0';
+    Follower* f = &followers[num_followers++];
+    if (UDP_FillSockAddr(&f->addr, host, atoi(colon + 1)) == -1) return -1;
+    f->received = -1;
+    f->acked = -1;
+    f->down = 0;
+  }
+  return 0;
+}
+
+
+// method to parse a host[/id]:weight[:rate] setting of the scheduler
+// with an id, it applies to the processes of host whose packets carry that id (see MFS_CLIENT)
+// and they are no longer part of the host's share
+int lfs_add_client(char* setting) {
+  int weight, rate = 0;
+  char* colon = strchr(setting, ':');
+  if (colon == NULL) return -1;
+  *colon = '\0';
+  if (sscanf(colon + 1, "%d:%d", &weight, &rate) < 1 || weight < 1 || rate < 0) return -1;
+
+  int id = 0, by_id = 0;
+  char* slash = strchr(setting, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    id = atoi(slash + 1);
+    by_id = 1;
+  }
+  struct sockaddr_in addr;
+  if (UDP_FillSockAddr(&addr, setting, 0) == -1) return -1;
+
+  Client* c = lfs_find_client(addr.sin_addr.s_addr, id, by_id);
+  if (c == NULL) c = lfs_new_client(addr.sin_addr.s_addr, id, by_id);
+  if (c == NULL) return -1;
+  c->fixed = 1;
+  c->weight = weight;
+  c->rate = rate;
+  c->tokens = rate;
+  c->refilled = lfs_clock_ns();
+  return 0;
+}
+
+
 // main method call init to run the server
 int main(int argc, char *argv[]) {
+  int shard = 0; // shard served by this process, 0 when the namespace is not sharded
+  int bad_args = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:aft:cw:")) != -1) {
+    if (opt == 's') shard = atoi(optarg);
+    else if (opt == 'w') bad_args |= lfs_add_client(optarg); // weight and rate limit of a client host
+    else if (opt == 'c') compress_blocks = 1; // compress blocks added to the log
+    else if (opt == 't') num_workers = atoi(optarg); // threads receiving requests, one per core
+    else if (opt == 'r') bad_args |= lfs_add_followers(optarg); // primary shipping its log to these followers
+    else if (opt == 'a') sync_replication = 1; // wait for follower acks instead of fsync
+    else if (opt == 'f') follower_mode = 1; // serve reads of the log shipped by a primary
+    else bad_args = -1; // unknown option, print usage
+  }
+
   // check if the command line argument is correct
-  if(argc != 3) {
-    printf("Usage: server [portnum] [file-system-image]\n");
+  if(argc - optind != 2 || shard < 0 || shard >= MFS_MAX_SHARDS || bad_args != 0 ||
+     num_workers < 1 || num_workers > MFS_MAX_WORKERS ||
+     (follower_mode == 1 && num_followers > 0) || (sync_replication == 1 && num_followers == 0)) {
+    printf("Usage: server [-s shard] [-t threads] [-c] [-w host[/id]:weight[:rate] ...] [-f | -r host:port,... [-a]] [portnum] [file-system-image]\n");
+    printf("  -a commits once followers ack instead of fsync; a primary whose machine crashes loses the writes\n"
+           "     it had not fsynced, acked or not, since it is never recovered from its followers\n");
     return -1;
   }
 
   // run the server
-  lfs_init(atoi(argv[1]),argv[2]);
+  lfs_init(atoi(argv[optind]), argv[optind+1], shard);
 
   return 0;
 }
@@ -26,6 +26,39 @@ int UDP_Open(int port) {
     return fd;
 }
 
+// create a socket bound to a port other sockets may be bound to as well
+// the kernel spreads incoming packets over all of them
+int UDP_OpenReuse(int port) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+
+    // set up the bind
+    struct sockaddr_in my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+
+    my_addr.sin_family      = AF_INET;
+    my_addr.sin_port        = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     bzero(addr, sizeof(struct sockaddr_in));